@@ -80,6 +80,19 @@ unsigned char * base64_encode(const unsigned char *src, size_t len,
 }
 
 
+/**
+ * base64_encoded_len - Length of Base64 encoded data
+ * @len: Length of the data to be encoded
+ * Returns: Number of bytes base64_encode() returns for @len bytes of data,
+ * not counting the nul terminator
+ */
+size_t base64_encoded_len(size_t len)
+{
+	/* a line feed follows every 18 complete 3-byte blocks */
+	return (len + 2) / 3 * 4 + len / 3 / 18;
+}
+
+
 /**
  * base64_decode - Base64 decode
  * @src: Data to be decoded
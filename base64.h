@@ -11,6 +11,7 @@
 
 unsigned char * base64_encode(const unsigned char *src, size_t len,
 			      size_t *out_len);
+size_t base64_encoded_len(size_t len);
 unsigned char * base64_decode(const unsigned char *src, size_t len,
 			      size_t *out_len);
 
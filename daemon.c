@@ -0,0 +1,615 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE         // fopencookie
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "daemon.h"
+
+/* Conversion daemon. Requests come in on a Unix domain socket, one per
+ * connection, as a frame holding the client's working directory and
+ * command line as NUL terminated strings. The reply is a series of frames
+ * carrying output for the client's stdout and stderr, ended by one with
+ * the exit status.
+ *
+ * Connections are handed to a pool of worker threads. Open jbf files are
+ * kept in an LRU cache and checked against the file system on each use,
+ * so repeated conversions of the same file skip opening and parsing it.
+ * Requests that modify the entries of a jbf file get it to themselves.
+ */
+
+#define DAEMON_CACHE       16           // open jbf files kept
+#define DAEMON_MAXREQUEST  (1 << 20)
+#define DAEMON_BUFSIZE     (64 * 1024)
+#define DAEMON_TIMEOUT     30           // seconds a client may stall
+
+// frame types
+#define FRAME_REQUEST      1
+#define FRAME_OUT          2
+#define FRAME_ERR          3
+#define FRAME_EXIT         4
+
+struct frame {
+    uint32_t      type;
+    uint32_t      length;    // of the data following the frame header
+};
+
+struct stream {
+    int           fd;
+    uint32_t      type;
+};
+
+struct cached {
+    struct cached *next;
+    char         *path;
+    uint32_t      flags;     // jbf_options flags that change the result
+    dev_t         dev;
+    ino_t         ino;
+    struct timespec mtime;
+    off_t         size;
+    jbf_file     *jbf;
+    uint32_t      users;
+    uint64_t      used;
+    int           stale;     // closed when the last user is done
+    pthread_rwlock_t lock;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct cached *head;
+    uint32_t      count;     // entries that are not stale
+    uint64_t      clock;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+struct queue {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+    int          *fds;
+    uint32_t      size;
+    uint32_t      head;
+    uint32_t      count;
+    daemon_handler handler;
+};
+
+static int write_all(int fd, const void *buf, size_t length)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    ssize_t ret;
+
+    while (length > 0) {
+        ret = send(fd, p, length, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t length)
+{
+    uint8_t *p = (uint8_t *) buf;
+    ssize_t ret;
+
+    while (length > 0) {
+        ret = recv(fd, p, length, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, uint32_t type, const void *data,
+                      uint32_t length)
+{
+    struct frame frame = { type, length };
+
+    if (write_all(fd, &frame, sizeof(frame)) != 0 ||
+        write_all(fd, data, length) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size)
+{
+    struct stream *stream = (struct stream *) cookie;
+
+    if (send_frame(stream->fd, stream->type, buf, size) != 0) {
+        return -1;
+    }
+    return size;
+}
+
+static int stream_close(void *cookie)
+{
+    free(cookie);
+    return 0;
+}
+
+/* A stdio stream whose output is sent to the client in frames of type. */
+static FILE *open_stream(int fd, uint32_t type)
+{
+    cookie_io_functions_t funcs = { NULL, stream_write, NULL, stream_close };
+    struct stream *stream;
+    FILE *file;
+
+    stream = (struct stream *) malloc(sizeof(*stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->fd   = fd;
+    stream->type = type;
+
+    file = fopencookie(stream, "w", funcs);
+    if (file == NULL) {
+        free(stream);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, DAEMON_BUFSIZE);
+    return file;
+}
+
+static void serve_connection(int fd, daemon_handler handler)
+{
+    struct frame frame;
+    char *request = NULL;
+    char **argv = NULL;
+    FILE *out = NULL;
+    FILE *err = NULL;
+    int32_t status = -1;
+    uint32_t argc;
+    uint32_t i;
+
+    if (read_all(fd, &frame, sizeof(frame)) != 0 ||
+        frame.type != FRAME_REQUEST ||
+        frame.length == 0 ||
+        frame.length > DAEMON_MAXREQUEST)
+    {
+        return;
+    }
+    request = (char *) malloc(frame.length);
+    if (request == NULL ||
+        read_all(fd, request, frame.length) != 0 ||
+        request[frame.length - 1] != '\0')
+    {
+        free(request);
+        return;
+    }
+
+    // working directory, then the arguments
+    for (i = 0, argc = 0; i < frame.length; i++) {
+        argc += request[i] == '\0';
+    }
+    argv = (char **) malloc((argc + 1) * sizeof(char *));
+    out = open_stream(fd, FRAME_OUT);
+    err = open_stream(fd, FRAME_ERR);
+    if (argv != NULL && out != NULL && err != NULL) {
+        argv[0] = "jbf2html";
+        for (i = strlen(request) + 1, argc = 1; i < frame.length;
+             i += strlen(&request[i]) + 1)
+        {
+            argv[argc++] = &request[i];
+        }
+        argv[argc] = NULL;
+
+        status = handler(request, argc, argv, out, err);
+    }
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (err != NULL) {
+        fclose(err);
+    }
+    send_frame(fd, FRAME_EXIT, &status, sizeof(status));
+    free(argv);
+    free(request);
+}
+
+static void *worker(void *arg)
+{
+    struct queue *queue = (struct queue *) arg;
+    int fd;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0) {
+            pthread_cond_wait(&queue->nonempty, &queue->lock);
+        }
+        fd = queue->fds[queue->head];
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+        pthread_cond_signal(&queue->nonfull);
+        pthread_mutex_unlock(&queue->lock);
+
+        serve_connection(fd, queue->handler);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Listen on socketpath and serve requests with handler on workers
+ * threads. Only returns if the daemon could not be started.
+ */
+int daemon_serve(const char *socketpath, uint32_t workers,
+                 daemon_handler handler)
+{
+    struct sockaddr_un addr = { 0 };
+    struct queue queue = {
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+        NULL, 0, 0, 0, handler
+    };
+    struct timeval timeout = { DAEMON_TIMEOUT, 0 };
+    pthread_t thread;
+    uint32_t i;
+    int sock;
+    int fd;
+
+    if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketpath);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    // replace a socket left behind, but not one that is in use
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        close(sock);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(socketpath);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(sock, SOMAXCONN) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    queue.size = 4 * workers;
+    queue.fds = (int *) malloc(queue.size * sizeof(int));
+    if (queue.fds == NULL) {
+        close(sock);
+        return -1;
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&thread, NULL, worker, &queue) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+    }
+    if (i == 0) {
+        free(queue.fds);
+        close(sock);
+        return -1;
+    }
+
+    for (;;) {
+        fd = accept(sock, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        // a client that neither sends its request nor reads the reply
+        // must not hold on to a worker
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == queue.size) {
+            pthread_cond_wait(&queue.nonfull, &queue.lock);
+        }
+        queue.fds[(queue.head + queue.count) % queue.size] = fd;
+        queue.count++;
+        pthread_cond_signal(&queue.nonempty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return 0;
+}
+
+/* Send the command line in argv, argc arguments without the program
+ * name, to the daemon on socketpath, and pass its output on to stdout and
+ * stderr. The exit status of the request is returned in *status. Returns
+ * -1 if the daemon could not be reached.
+ */
+int daemon_client(const char *socketpath, int argc, char **argv,
+                  int *status)
+{
+    struct sockaddr_un addr = { 0 };
+    struct frame frame;
+    char cwd[4096];
+    char *request;
+    char *data = NULL;
+    size_t length;
+    int32_t exitstatus;
+    int sock = -1;
+    int rv = -1;
+    int i;
+
+    *status = -1;
+    if (getcwd(cwd, sizeof(cwd)) == NULL ||
+        strlen(socketpath) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketpath);
+
+    length = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    request = (char *) malloc(length);
+    if (request == NULL) {
+        return -1;
+    }
+    strcpy(request, cwd);
+    length = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        strcpy(&request[length], argv[i]);
+        length += strlen(argv[i]) + 1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 ||
+        connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        send_frame(sock, FRAME_REQUEST, request, length) != 0)
+    {
+        goto clean;
+    }
+
+    while (read_all(sock, &frame, sizeof(frame)) == 0) {
+        data = (char *) realloc(data, frame.length + 1);
+        if (data == NULL || read_all(sock, data, frame.length) != 0) {
+            break;
+        }
+        if (frame.type == FRAME_OUT) {
+            fwrite(data, 1, frame.length, stdout);
+        }
+        else if (frame.type == FRAME_ERR) {
+            fwrite(data, 1, frame.length, stderr);
+        }
+        else if (frame.type == FRAME_EXIT &&
+                 frame.length == sizeof(exitstatus))
+        {
+            memcpy(&exitstatus, data, sizeof(exitstatus));
+            *status = exitstatus;
+            rv = 0;
+            break;
+        }
+    }
+
+ clean:
+    if (sock != -1) {
+        close(sock);
+    }
+    free(data);
+    free(request);
+    return rv;
+}
+
+/***************************************************************************
+ * jbf file cache
+ */
+
+static void cache_remove(struct cached *entry)
+{
+    struct cached **p;
+
+    for (p = &cache.head; *p != entry; p = &(*p)->next) {
+    }
+    *p = entry->next;
+
+    jbf_close(entry->jbf);
+    pthread_rwlock_destroy(&entry->lock);
+    free(entry->path);
+    free(entry);
+}
+
+/* Close the least recently used files beyond DAEMON_CACHE. Called with
+ * the cache locked.
+ */
+static void cache_trim(void)
+{
+    struct cached *entry;
+    struct cached *lru;
+
+    while (cache.count > DAEMON_CACHE) {
+        lru = NULL;
+        for (entry = cache.head; entry != NULL; entry = entry->next) {
+            if (!entry->stale && entry->users == 0 &&
+                (lru == NULL || entry->used < lru->used))
+            {
+                lru = entry;
+            }
+        }
+        if (lru == NULL) {
+            return;
+        }
+        cache.count--;
+        cache_remove(lru);
+    }
+}
+
+/* Open filename like jbf_open_opts(), through the cache. With exclusive,
+ * the caller is the only user of the jbf file until daemon_close().
+ * Memory budgets do not apply to cached files.
+ */
+int daemon_open(char *filename, jbf_options *opts, int exclusive,
+                jbf_file **jbf)
+{
+    struct cached *entry;
+    struct stat stats;
+    jbf_options cacheopts = *opts;
+    uint32_t flags = opts->flags & JBFOPT_RECOVER;
+    int ret;
+
+ again:
+    if (stat(filename, &stats) != 0 || !S_ISREG(stats.st_mode)) {
+        return JBFEARGS;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (entry = cache.head; entry != NULL; entry = entry->next) {
+        if (!entry->stale && entry->flags == flags &&
+            !strcmp(entry->path, filename))
+        {
+            break;
+        }
+    }
+    if (entry != NULL &&
+        (entry->dev != stats.st_dev ||
+         entry->ino != stats.st_ino ||
+         entry->size != stats.st_size ||
+         entry->mtime.tv_sec != stats.st_mtim.tv_sec ||
+         entry->mtime.tv_nsec != stats.st_mtim.tv_nsec))
+    {
+        // the file has changed since it was opened
+        entry->stale = 1;
+        cache.count--;
+        if (entry->users == 0) {
+            cache_remove(entry);
+        }
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        entry->users++;
+        entry->used = ++cache.clock;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (entry == NULL) {
+        entry = (struct cached *) calloc(1, sizeof(*entry));
+        if (entry == NULL) {
+            return JBFEMEM;
+        }
+        entry->path = strdup(filename);
+
+        cacheopts.budget = 0;
+        ret = jbf_open_opts(filename, &cacheopts, &entry->jbf);
+        if (ret != JBFSUCCESS || entry->path == NULL) {
+            if (ret == JBFSUCCESS) {
+                jbf_close(entry->jbf);
+                ret = JBFEMEM;
+            }
+            free(entry->path);
+            free(entry);
+            return ret;
+        }
+
+        entry->flags = flags;
+        entry->dev   = stats.st_dev;
+        entry->ino   = stats.st_ino;
+        entry->size  = stats.st_size;
+        entry->mtime = stats.st_mtim;
+        entry->users = 1;
+        pthread_rwlock_init(&entry->lock, NULL);
+
+        pthread_mutex_lock(&cache.lock);
+        entry->used = ++cache.clock;
+        entry->next = cache.head;
+        cache.head = entry;
+        cache.count++;
+        cache_trim();
+        pthread_mutex_unlock(&cache.lock);
+    }
+
+    if (exclusive) {
+        pthread_rwlock_wrlock(&entry->lock);
+    }
+    else {
+        pthread_rwlock_rdlock(&entry->lock);
+    }
+
+    // an exclusive user may have modified the entries while we waited
+    pthread_mutex_lock(&cache.lock);
+    if (entry->stale) {
+        pthread_rwlock_unlock(&entry->lock);
+        entry->users--;
+        if (entry->users == 0) {
+            cache_remove(entry);
+        }
+        pthread_mutex_unlock(&cache.lock);
+        goto again;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    *jbf = entry->jbf;
+    return JBFSUCCESS;
+}
+
+/* Release a jbf file from daemon_open(). With evict, it is closed once it
+ * is no longer in use, e.g. because its entries were modified.
+ */
+void daemon_close(jbf_file *jbf, int evict)
+{
+    struct cached *entry;
+
+    pthread_mutex_lock(&cache.lock);
+    for (entry = cache.head; entry->jbf != jbf; entry = entry->next) {
+    }
+    pthread_rwlock_unlock(&entry->lock);
+
+    entry->users--;
+    if (evict && !entry->stale) {
+        entry->stale = 1;
+        cache.count--;
+    }
+    if (entry->stale && entry->users == 0) {
+        cache_remove(entry);
+    }
+    cache_trim();
+    pthread_mutex_unlock(&cache.lock);
+}
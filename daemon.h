@@ -0,0 +1,50 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include "jbf.h"
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+/* Runs one request: argc and argv are the command line given to the
+ * client, argv[0] being the program name, and relative paths in it are
+ * relative to cwd. out and err lead to the client's stdout and stderr.
+ * Returns the exit status for the client.
+ */
+typedef int (*daemon_handler)(const char *cwd, int argc, char **argv,
+                              FILE *out, FILE *err);
+
+int daemon_serve(const char *socketpath, uint32_t workers,
+                 daemon_handler handler);
+int daemon_client(const char *socketpath, int argc, char **argv,
+                  int *status);
+
+int daemon_open(char *filename, jbf_options *opts, int exclusive,
+                jbf_file **jbf);
+void daemon_close(jbf_file *jbf, int evict);
+
+#endif // _DAEMON_H
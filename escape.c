@@ -0,0 +1,163 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "escape.h"
+
+/* File names are escaped for html and for urls in one go. Most names need
+ * neither, so names are first scanned for the bytes that need attention
+ * in either form, 16 at a time, and names without any are used as they
+ * are. Other names are escaped a clean span at a time.
+ *
+ * Bytes left as they are: ASCII letters and digits, and -._~/!$()*+,;=:@
+ * which are all allowed in a url path and plain in html.
+ */
+
+static int plain(uint8_t c)
+{
+    return (c >= 'a' && c <= 'z') ||
+           (c >= '@' && c <= 'Z') ||
+           (c >= '(' && c <= ';') ||
+           c == '!' || c == '$' || c == '=' || c == '_' || c == '~';
+}
+
+// length of the span of plain bytes at the start of s
+static size_t plain_span(const uint8_t *s, size_t length)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    {
+        // signed compares; bytes from 0x80 are negative and never plain
+        const __m128i lower_lo = _mm_set1_epi8('a' - 1);
+        const __m128i lower_hi = _mm_set1_epi8('z' + 1);
+        const __m128i upper_lo = _mm_set1_epi8('@' - 1);
+        const __m128i upper_hi = _mm_set1_epi8('Z' + 1);
+        const __m128i punct_lo = _mm_set1_epi8('(' - 1);
+        const __m128i punct_hi = _mm_set1_epi8(';' + 1);
+        __m128i v;
+        __m128i m;
+        unsigned mask;
+
+        for (; i + 16 <= length; i += 16) {
+            v = _mm_loadu_si128((const __m128i *) &s[i]);
+            m = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_and_si128(_mm_cmpgt_epi8(v, lower_lo),
+                                  _mm_cmplt_epi8(v, lower_hi)),
+                    _mm_and_si128(_mm_cmpgt_epi8(v, upper_lo),
+                                  _mm_cmplt_epi8(v, upper_hi))),
+                _mm_and_si128(_mm_cmpgt_epi8(v, punct_lo),
+                              _mm_cmplt_epi8(v, punct_hi)));
+            m = _mm_or_si128(
+                _mm_or_si128(m,
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('!')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('$')))),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+            mask = ~_mm_movemask_epi8(m) & 0xffff;
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    while (i < length && plain(s[i])) {
+        i++;
+    }
+    return i;
+}
+
+int escape_name(const char *name, size_t length, escaped_name *esc)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const uint8_t *s = (const uint8_t *) name;
+    char *html;
+    char *url;
+    size_t span;
+    size_t i;
+
+    esc->html = name;
+    esc->url  = name;
+    esc->buf  = NULL;
+
+    span = plain_span(s, length);
+    if (span == length) {
+        return 0;
+    }
+
+    // worst cases: &quot; for html, %XX for url
+    esc->buf = (char *) malloc(6 * length + 1 + 3 * length + 1);
+    if (esc->buf == NULL) {
+        return -1;
+    }
+    html = esc->buf;
+    url  = esc->buf + 6 * length + 1;
+    esc->html = html;
+    esc->url  = url;
+
+    for (i = 0; ; ) {
+        memcpy(html, &s[i], span);
+        memcpy(url, &s[i], span);
+        html += span;
+        url  += span;
+        i += span;
+        if (i == length) {
+            break;
+        }
+
+        switch (s[i]) {
+        case '&':  memcpy(html, "&amp;", 5);  html += 5; break;
+        case '<':  memcpy(html, "&lt;", 4);   html += 4; break;
+        case '>':  memcpy(html, "&gt;", 4);   html += 4; break;
+        case '"':  memcpy(html, "&quot;", 6); html += 6; break;
+        case '\'': memcpy(html, "&#39;", 5);  html += 5; break;
+        default:   *html++ = s[i];                       break;
+        }
+        *url++ = '%';
+        *url++ = hex[s[i] >> 4];
+        *url++ = hex[s[i] & 0xf];
+
+        i++;
+        span = plain_span(&s[i], length - i);
+    }
+    *html = '\0';
+    *url  = '\0';
+    return 0;
+}
+
+void escape_free(escaped_name *esc)
+{
+    free(esc->buf);
+    esc->buf = NULL;
+}
@@ -0,0 +1,45 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stddef.h>
+
+#ifndef _ESCAPE_H
+#define _ESCAPE_H
+
+/* Escaped forms of a file name: html for text and attribute values, and
+ * url, percent-encoded, for links. Both point to the name itself if it
+ * needs no escaping. escape_name() returns -1 if there is no memory for
+ * the escaped forms.
+ */
+typedef struct {
+    const char   *html;
+    const char   *url;
+    char         *buf;       // storage for the escaped forms, if any
+} escaped_name;
+
+int escape_name(const char *name, size_t length, escaped_name *esc);
+void escape_free(escaped_name *esc);
+
+#endif // _ESCAPE_H
@@ -24,8 +24,11 @@
  *
  ***************************************************************************/
 #include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,7 +37,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <linux/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "jbf.h"
+#include "uring.h"
 
 //#define DEBUG
 
@@ -61,114 +69,1133 @@ struct entryhdr {
     uint8_t       jpghdr[];
 } __attribute__ ((packed));
 
-struct mmap_info {
-    void         *addr;
+/* I/O backends. A backend makes the file available at io->addr and
+ * guarantees that bytes [0, end) are readable once wait() has returned 0.
+ */
+struct jbf_io;
+
+struct jbf_io_ops {
+    int         (*open)(struct jbf_io *io, int fd);
+    int         (*wait)(struct jbf_io *io, size_t end);
+    void        (*release)(struct jbf_io *io, size_t start, size_t end,
+                           int drop);
+    void        (*close)(struct jbf_io *io);
+};
+
+struct jbf_io {
+    const struct jbf_io_ops *ops;
+    uint8_t      *addr;
     size_t        length;
+    size_t        window;     // bytes kept in memory behind the reader,
+                              // 0 for no limit
+    size_t        released;   // [0, released) has been released
+    size_t        next;       // offset of the first entry not parsed
+    uint32_t      parsed;     // entries parsed
+    void         *priv;
+};
+
+static int mmap_open(struct jbf_io *io, int fd);
+static int mmap_wait(struct jbf_io *io, size_t end);
+static void mmap_release(struct jbf_io *io, size_t start, size_t end,
+                         int drop);
+static void mmap_close(struct jbf_io *io);
+
+static const struct jbf_io_ops mmap_ops = {
+    .open    = mmap_open,
+    .wait    = mmap_wait,
+    .release = mmap_release,
+    .close   = mmap_close,
+};
+
+static int uring_open(struct jbf_io *io, int fd);
+static int uring_wait(struct jbf_io *io, size_t end);
+static void uring_close(struct jbf_io *io);
+
+static const struct jbf_io_ops uring_ops = {
+    .open  = uring_open,
+    .wait  = uring_wait,
+    .close = uring_close,
 };
 
-static int parse_jbf(jbf_file *jbfdata, struct mmap_info *mmap_info);
-static int parse_entry(uint8_t *data, jbf_entry *entry);
-static void free_jbf(jbf_file *jbf);
-static void free_entry(jbf_entry *entry);
+static int parse_jbf(jbf_file *jbfdata, struct jbf_io *io, jbf_options *opts);
+static int plausible_entry(jbf_entry *entry);
+static size_t find_entry(struct jbf_io *io, size_t from, size_t end);
+static int parse_parallel(jbf_file *jbf, struct jbf_io *io, uint32_t count,
+                          uint32_t threads);
+static int parse_entry(struct jbf_io *io, size_t offset, jbf_entry *entry,
+                       size_t *size);
+static int write_entry(FILE *out, jbf_entry *entry);
+static mode_t current_umask(void);
+static void free_jbf(jbf_file *jbf);
+static void free_entry(jbf_entry *entry);
+
+/* Wait for bytes [0, end) of the file. Returns 1 if end lies past the end
+ * of the file, and -1 on read errors.
+ */
+static int io_wait(struct jbf_io *io, size_t end)
+{
+    if (end > io->length) {
+        return 1;
+    }
+    return io->ops->wait(io, end);
+}
+
+/* Release the file data before offset upto, once more than io->window
+ * bytes are held. With drop set the data will not be read again, and it is
+ * dropped from the page cache as well.
+ */
+static void io_release(struct jbf_io *io, size_t upto, int drop)
+{
+    size_t end;
+
+    if (io->window == 0 ||
+        io->ops->release == NULL ||
+        upto < io->released + io->window)
+    {
+        return;
+    }
+
+    end = upto & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+    if (end > io->released) {
+        io->ops->release(io, io->released, end, drop);
+        io->released = end;
+    }
+}
+
+int jbf_open(char *filename, jbf_file **jbfp)
+{
+    return jbf_open_opts(filename, NULL, jbfp);
+}
+
+int jbf_open_opts(char *filename, jbf_options *opts, jbf_file **jbfp)
+{
+    int fd;
+    struct stat stats;
+    int ret;
+    int rv;
+    jbf_file *jbf = NULL;
+    struct jbf_io *io = NULL;
+    uint32_t flags = opts != NULL ? opts->flags : 0;
+
+    // allocate memory
+    jbf = (jbf_file *) malloc(sizeof(*jbf));
+    if (jbf == NULL) {
+        rv = JBFEMEM;
+        goto clean;
+    }
+    memset(jbf, 0, sizeof(*jbf));
+
+    io = (struct jbf_io *) malloc(sizeof(*io));
+    if (io == NULL) {
+        rv = JBFEMEM;
+        goto clean;
+    }
+    memset(io, 0, sizeof(*io));
+
+    jbf->_handle = (void *) io;
+
+    // open file
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        rv = JBFEARGS;
+        goto clean;
+    }
+
+    // find file size
+    ret = fstat(fd, &stats);
+    if (ret != 0) {
+        close(fd);
+        rv = JBFEARGS;
+        goto clean;
+    }
+    io->length = stats.st_size;
+
+    // jbf header needs to be at least 0x400 bytes long
+    if (io->length < 0x400) {
+        close(fd);
+        rv = JBFECORRUPT;
+        goto clean;
+    }
+
+    // a memory budget limits how much of the file is kept behind the
+    // reader, 0x400 bytes at least
+    if (opts != NULL && opts->budget != 0) {
+        io->window = opts->budget / 2;
+        if (io->window < 0x400) {
+            io->window = 0x400;
+        }
+    }
+
+    // read the file through io_uring if asked to, falling back to mmap
+    // when io_uring is not available. io_uring reads into anonymous
+    // memory which can not be released and read again, so it can not be
+    // used with a memory budget.
+    ret = -1;
+    if ((flags & JBFOPT_URING) && io->window == 0) {
+        io->ops = &uring_ops;
+        ret = io->ops->open(io, fd);
+    }
+    if (ret != 0) {
+        io->ops = &mmap_ops;
+        ret = io->ops->open(io, fd);
+    }
+    close(fd);
+    if (ret != 0) {
+        io->ops = NULL;
+        rv = JBFEMEM;
+        goto clean;
+    }
+
+    // parse file
+    ret = parse_jbf(jbf, io, opts);
+    if (ret != 0) {
+        rv = JBFECORRUPT;
+        goto clean;
+    }
+
+    // success
+    *jbfp = jbf;
+    return JBFSUCCESS;
+
+ clean:
+    jbf_close(jbf);
+    return rv;
+}
+
+int jbf_close(jbf_file *jbf)
+{
+    if (jbf != NULL) {
+        struct jbf_io *io = (struct jbf_io *) jbf->_handle;
+        if (io != NULL &&
+            io->ops != NULL)
+        {
+            io->ops->close(io);
+        }
+        free_jbf(jbf);
+        free(jbf);
+        free(io);
+    }
+    return JBFSUCCESS;
+}
+
+/* Write jbf to filename. The file is written to a temporary file next to
+ * filename, which then replaces filename, so that readers never see a
+ * partially written file. The header of the file jbf was read from is
+ * kept, apart from the entry count.
+ */
+int jbf_write(jbf_file *jbf, char *filename)
+{
+    uint8_t hdrdata[0x400];
+    struct filehdr *hdr = (struct filehdr *) hdrdata;
+    struct jbf_io *io = (struct jbf_io *) jbf->_handle;
+    struct stat stats;
+    mode_t mode;
+    char *tmpname;
+    FILE *out = NULL;
+    int fd;
+    int i;
+    int rv = JBFEIO;
+
+    // header
+    if (io != NULL && io->ops != NULL) {
+        memcpy(hdrdata, io->addr, sizeof(hdrdata));
+    }
+    else {
+        memset(hdrdata, 0, sizeof(hdrdata));
+        memcpy(hdr->magic, JBF_MAGIC, 16);
+        if (jbf->dirname != NULL) {
+            strncpy((char *) &hdrdata[23], jbf->dirname, 0x400 - 23 - 1);
+        }
+    }
+    hdr->count = htole32(jbf->entrycount);
+
+    // temporary file, with the permissions of the file it replaces
+    tmpname = (char *) malloc(strlen(filename) + 8);
+    if (tmpname == NULL) {
+        return JBFEMEM;
+    }
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    fd = mkstemp(tmpname);
+    if (fd == -1) {
+        free(tmpname);
+        return JBFEIO;
+    }
+
+    if (stat(filename, &stats) == 0) {
+        mode = stats.st_mode & 07777;
+    }
+    else {
+        mode = 0666 & ~current_umask();
+    }
+    fchmod(fd, mode);
+
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        goto clean;
+    }
+
+    if (fwrite(hdrdata, sizeof(hdrdata), 1, out) != 1) {
+        goto clean;
+    }
+
+    for (i = 0; i < jbf->entrycount; i++) {
+        rv = write_entry(out, &jbf->entries[i]);
+        if (rv != JBFSUCCESS) {
+            goto clean;
+        }
+    }
+    rv = JBFEIO;
+
+    if (fflush(out) != 0 ||
+        fsync(fileno(out)) != 0)
+    {
+        goto clean;
+    }
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto clean;
+    }
+    out = NULL;
+
+    if (rename(tmpname, filename) != 0) {
+        goto clean;
+    }
+
+    free(tmpname);
+    return JBFSUCCESS;
+
+ clean:
+    if (out != NULL) {
+        fclose(out);
+    }
+    unlink(tmpname);
+    free(tmpname);
+    return rv;
+}
+
+/* The umask of the process. umask() can only read it by changing it,
+ * which races with other threads creating files, so it is read from
+ * /proc instead. Falls back to 022 if /proc is not available.
+ */
+static mode_t current_umask(void)
+{
+    char line[64];
+    unsigned int mask;
+    mode_t rv = 022;
+    FILE *status;
+
+    status = fopen("/proc/self/status", "r");
+    if (status == NULL) {
+        return rv;
+    }
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Umask: %o", &mask) == 1) {
+            rv = mask & 0777;
+            break;
+        }
+    }
+    fclose(status);
+    return rv;
+}
+
+/* Size of a name table for count entries: a power of two, at most half
+ * full.
+ */
+static size_t name_tablesize(uint32_t count)
+{
+    size_t tablesize = 2;
+
+    while (tablesize < 2 * (size_t) count) {
+        tablesize *= 2;
+    }
+    return tablesize;
+}
+
+/* Find the slot for the file name of entry in an open addressing table
+ * holding index + 1 into entries for each name. Returns the slot holding
+ * the name, or the empty slot where it belongs.
+ */
+static uint32_t *name_slot(uint32_t *table, size_t tablesize,
+                           jbf_entry *entries, jbf_entry *entry)
+{
+    uint64_t hash;
+    size_t slot;
+    uint32_t j;
+    uint32_t k;
+
+    // FNV-1a
+    hash = 0xcbf29ce484222325ULL;
+    for (k = 0; k < entry->filenamelength; k++) {
+        hash ^= (uint8_t) entry->filename[k];
+        hash *= 0x100000001b3ULL;
+    }
+
+    for (slot = hash & (tablesize - 1); table[slot] != 0;
+         slot = (slot + 1) & (tablesize - 1))
+    {
+        j = table[slot] - 1;
+        if (entries[j].filenamelength == entry->filenamelength &&
+            !memcmp(entries[j].filename, entry->filename,
+                    entry->filenamelength))
+        {
+            break;
+        }
+    }
+    return &table[slot];
+}
+
+/* Build a name table for jbf, holding the most recent entry for each
+ * name. latest[i] is set for the entries in the table.
+ */
+static int index_names(jbf_file *jbf, size_t tablesize, uint32_t **table,
+                       uint8_t **latest)
+{
+    uint32_t *slot;
+    uint32_t i;
+    uint32_t j;
+
+    *table  = (uint32_t *) calloc(tablesize, sizeof(uint32_t));
+    *latest = (uint8_t *) calloc(jbf->entrycount + 1, 1);
+    if (*table == NULL || *latest == NULL) {
+        return JBFEMEM;
+    }
+
+    for (i = 0; i < jbf->entrycount; i++) {
+        slot = name_slot(*table, tablesize, jbf->entries, &jbf->entries[i]);
+        if (*slot == 0) {
+            *slot = i + 1;
+            (*latest)[i] = 1;
+        }
+        else {
+            j = *slot - 1;
+            if (jbf->entries[i].filetime >= jbf->entries[j].filetime) {
+                (*latest)[j] = 0;
+                (*latest)[i] = 1;
+                *slot = i + 1;
+            }
+        }
+    }
+    return JBFSUCCESS;
+}
+
+/* Remove stale entries from jbf: entries for files that do not exist in
+ * imagedir, and all but the most recent entry for each file name. If
+ * imagedir is NULL, only duplicates are removed. The number of entries
+ * removed for each reason is returned in *missing and *duplicates.
+ */
+int jbf_compact(jbf_file *jbf, char *imagedir, uint32_t *missing,
+                uint32_t *duplicates)
+{
+    uint32_t *table;
+    uint8_t *keep;
+    size_t tablesize = name_tablesize(jbf->entrycount);
+    uint32_t *slot;
+    uint32_t i;
+    uint32_t j;
+    int ret;
+
+    *missing = 0;
+    *duplicates = 0;
+
+    if (imagedir != NULL) {
+        ret = jbf_check(jbf, imagedir);
+        if (ret != JBFSUCCESS) {
+            return ret;
+        }
+    }
+
+    table = (uint32_t *) calloc(tablesize, sizeof(uint32_t));
+    keep  = (uint8_t *) calloc(jbf->entrycount + 1, 1);
+    if (table == NULL || keep == NULL) {
+        free(table);
+        free(keep);
+        return JBFEMEM;
+    }
+
+    for (i = 0; i < jbf->entrycount; i++) {
+        jbf_entry *entry = &jbf->entries[i];
+
+        if (imagedir != NULL && (entry->status & JBFSTAT_MISSING)) {
+            (*missing)++;
+            continue;
+        }
+
+        slot = name_slot(table, tablesize, jbf->entries, entry);
+        if (*slot == 0) {
+            *slot = i + 1;
+            keep[i] = 1;
+        }
+        else {
+            j = *slot - 1;
+            (*duplicates)++;
+            if (entry->filetime >= jbf->entries[j].filetime) {
+                keep[j] = 0;
+                keep[i] = 1;
+                *slot = i + 1;
+            }
+        }
+    }
+
+    // pack the surviving entries, keeping their order
+    for (i = 0, j = 0; i < jbf->entrycount; i++) {
+        if (keep[i]) {
+            jbf->entries[j++] = jbf->entries[i];
+        }
+        else {
+            free_entry(&jbf->entries[i]);
+        }
+    }
+    jbf->entrycount = j;
+
+    free(table);
+    free(keep);
+    return JBFSUCCESS;
+}
+
+/***************************************************************************
+ * image file checks
+ *
+ * The image file of each entry is looked up with statx on an io_uring,
+ * keeping CHECK_DEPTH lookups in flight so that network file systems are
+ * not waited on one round trip at a time. Where io_uring or its statx
+ * operation is not available, CHECK_THREADS threads do the same with
+ * fstatat.
+ */
+
+#define CHECK_DEPTH       256
+#define CHECK_THREADS     32
+
+struct checkpool {
+    jbf_file     *jbf;
+    int           dirfd;
+    uint32_t      next;
+};
+
+/* Set the status of entry from the stat results of its file. Times are
+ * compared to the second, as that is all some file systems keep.
+ */
+static void check_result(jbf_entry *entry, int found, uint32_t mode,
+                         uint64_t size, int64_t mtime)
+{
+    int64_t filetime;
+
+    entry->status = 0;
+    if (!found || !S_ISREG(mode)) {
+        entry->status = JBFSTAT_MISSING;
+        return;
+    }
+
+    filetime = entry->filetime / TICKS_PER_SECOND - EPOCH_DIFFERENCE;
+    if (size != entry->filesize) {
+        entry->status |= JBFSTAT_FILESIZE;
+    }
+    if (mtime != filetime) {
+        entry->status |= JBFSTAT_FILETIME;
+    }
+}
+
+/* Check all entries with statx on an io_uring. Returns -1 if io_uring or
+ * statx on it is not available, so that the caller can fall back.
+ */
+static int check_uring(jbf_file *jbf, int dirfd)
+{
+    struct uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct statx *stx;
+    uint32_t *slots;
+    uint32_t nslots;
+    uint32_t slot;
+    uint32_t next = 0;
+    uint32_t inflight = 0;
+    uint32_t queued;
+    uint32_t i;
+    int res;
+    int rv = 0;
+
+    if (uring_init(&ring, CHECK_DEPTH) != 0) {
+        return -1;
+    }
+    stx   = (struct statx *) malloc(CHECK_DEPTH * sizeof(struct statx));
+    slots = (uint32_t *) malloc(CHECK_DEPTH * sizeof(uint32_t));
+    if (stx == NULL || slots == NULL) {
+        rv = -1;
+        goto clean;
+    }
+    for (nslots = 0; nslots < CHECK_DEPTH; nslots++) {
+        slots[nslots] = nslots;
+    }
+
+    while ((next < jbf->entrycount && rv == 0) || inflight > 0) {
+        // keep the queue full
+        queued = 0;
+        while (rv == 0 &&
+               next < jbf->entrycount &&
+               nslots > 0 &&
+               (sqe = uring_get_sqe(&ring)) != NULL)
+        {
+            slot = slots[--nslots];
+            sqe->opcode      = IORING_OP_STATX;
+            sqe->fd          = dirfd;
+            sqe->addr        = (uint64_t) (uintptr_t)
+                               jbf->entries[next].filename;
+            sqe->len         = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+            sqe->off         = (uint64_t) (uintptr_t) &stx[slot];
+            sqe->statx_flags = 0;
+            sqe->user_data   = (uint64_t) next << 32 | slot;
+            next++;
+            queued++;
+        }
+
+        // a failed submit has submitted nothing
+        if (uring_submit(&ring, 1) < 0) {
+            rv = -1;
+            break;
+        }
+        inflight += queued;
+
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            i    = cqe->user_data >> 32;
+            slot = cqe->user_data & 0xffffffff;
+            res  = cqe->res;
+            uring_cqe_seen(&ring);
+            slots[nslots++] = slot;
+            inflight--;
+
+            // kernels without statx on io_uring fail it as invalid
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                rv = -1;
+                continue;
+            }
+            check_result(&jbf->entries[i], res == 0, stx[slot].stx_mode,
+                         stx[slot].stx_size, stx[slot].stx_mtime.tv_sec);
+        }
+    }
+
+ clean:
+    // the kernel writes to stx until the statx calls complete
+    while (inflight > 0 && uring_wait_cqe(&ring) != NULL) {
+        uring_cqe_seen(&ring);
+        inflight--;
+    }
+    uring_exit(&ring);
+    free(stx);
+    free(slots);
+    return rv;
+}
+
+static void *check_thread(void *arg)
+{
+    struct checkpool *pool = (struct checkpool *) arg;
+    struct stat stats;
+    uint32_t i;
+    int found;
+
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+           pool->jbf->entrycount)
+    {
+        found = fstatat(pool->dirfd, pool->jbf->entries[i].filename,
+                        &stats, 0) == 0;
+        check_result(&pool->jbf->entries[i], found, stats.st_mode,
+                     stats.st_size, stats.st_mtime);
+    }
+    return NULL;
+}
+
+/* Check all entries with a pool of threads doing fstatat. */
+static void check_threads(jbf_file *jbf, int dirfd)
+{
+    struct checkpool pool = { jbf, dirfd, 0 };
+    pthread_t threads[CHECK_THREADS];
+    uint32_t started;
+
+    for (started = 0; started < CHECK_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, check_thread,
+                           &pool) != 0)
+        {
+            break;
+        }
+    }
+
+    // whatever is left if no thread could be started
+    check_thread(&pool);
+
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+}
+
+/* Look up the image file of each entry in imagedir, and set the status of
+ * the entry to JBFSTAT_MISSING if it does not exist as a regular file, or
+ * to JBFSTAT_FILESIZE and JBFSTAT_FILETIME for what differs between the
+ * file and the entry.
+ */
+int jbf_check(jbf_file *jbf, char *imagedir)
+{
+    int dirfd;
+
+    dirfd = open(imagedir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        return JBFEARGS;
+    }
+
+    if (check_uring(jbf, dirfd) != 0) {
+        check_threads(jbf, dirfd);
+    }
+
+    close(dirfd);
+    return JBFSUCCESS;
+}
+
+/* Compare two versions of a jbf file. Entries are matched by file name,
+ * using the most recent entry for names that occur more than once, and
+ * report is called for each entry that was added, removed or changed, with
+ * JBFDIFF_* flags telling what differs. Added and changed entries are
+ * reported in the order of new, followed by the removed entries in the
+ * order of old.
+ */
+int jbf_diff(jbf_file *old, jbf_file *new, jbf_diff_report report,
+             void *arg)
+{
+    uint32_t *oldtable = NULL;
+    uint32_t *newtable = NULL;
+    uint8_t *oldlatest = NULL;
+    uint8_t *newlatest = NULL;
+    uint8_t *seen = NULL;
+    size_t oldsize = name_tablesize(old->entrycount);
+    size_t newsize = name_tablesize(new->entrycount);
+    uint32_t *slot;
+    uint32_t changes;
+    uint32_t i;
+    int rv = JBFEMEM;
+
+    seen = (uint8_t *) calloc(old->entrycount + 1, 1);
+    if (seen == NULL ||
+        index_names(old, oldsize, &oldtable, &oldlatest) != JBFSUCCESS ||
+        index_names(new, newsize, &newtable, &newlatest) != JBFSUCCESS)
+    {
+        goto clean;
+    }
+
+    for (i = 0; i < new->entrycount; i++) {
+        jbf_entry *entry = &new->entries[i];
+        jbf_entry *oldentry;
+
+        if (!newlatest[i]) {
+            continue;
+        }
+
+        slot = name_slot(oldtable, oldsize, old->entries, entry);
+        if (*slot == 0) {
+            report(arg, JBFDIFF_ADDED, NULL, entry);
+            continue;
+        }
+
+        oldentry = &old->entries[*slot - 1];
+        seen[*slot - 1] = 1;
+
+        changes = 0;
+        if (entry->filetime != oldentry->filetime) {
+            changes |= JBFDIFF_FILETIME;
+        }
+        if (entry->filesize != oldentry->filesize) {
+            changes |= JBFDIFF_FILESIZE;
+        }
+        // entries without thumbnail have no data to compare
+        if (entry->thumbnail.size != oldentry->thumbnail.size ||
+            (entry->thumbnail.size != 0 &&
+             memcmp(entry->thumbnail.data, oldentry->thumbnail.data,
+                    entry->thumbnail.size)))
+        {
+            changes |= JBFDIFF_THUMBNAIL;
+        }
+        if (changes != 0) {
+            report(arg, changes, oldentry, entry);
+        }
+    }
+
+    for (i = 0; i < old->entrycount; i++) {
+        if (oldlatest[i] && !seen[i]) {
+            report(arg, JBFDIFF_REMOVED, &old->entries[i], NULL);
+        }
+    }
+    rv = JBFSUCCESS;
+
+ clean:
+    free(oldtable);
+    free(newtable);
+    free(oldlatest);
+    free(newlatest);
+    free(seen);
+    return rv;
+}
+
+/* Make entry index of jbf, and its thumbnail data, available. Files opened
+ * with JBFOPT_STREAM are parsed up to the entry, and must be fetched from
+ * in order; other files have been parsed and read completely already.
+ */
+int jbf_fetch(jbf_file *jbf, uint32_t index)
+{
+    struct jbf_io *io = (struct jbf_io *) jbf->_handle;
+    jbf_entry *entry;
+    size_t size;
+
+    if (index >= jbf->entrycount) {
+        return JBFEARGS;
+    }
+    while (io->parsed <= index) {
+        if (parse_entry(io, io->next, &jbf->entries[io->parsed],
+                        &size) != 0)
+        {
+            return JBFECORRUPT;
+        }
+        io->next += size;
+        io->parsed++;
+    }
+
+    entry = &jbf->entries[index];
+    if (entry->thumbnail.data != NULL &&
+        io_wait(io, entry->thumbnail.data + entry->thumbnail.size -
+                io->addr) != 0)
+    {
+        return JBFEIO;
+    }
+    return JBFSUCCESS;
+}
+
+int jbf_release(jbf_file *jbf, jbf_entry *entry)
+{
+    struct jbf_io *io = (struct jbf_io *) jbf->_handle;
+
+    if (entry->thumbnail.data != NULL) {
+        io_release(io,
+                   entry->thumbnail.data + entry->thumbnail.size - io->addr,
+                   1);
+    }
+    return JBFSUCCESS;
+}
+
+static int mmap_open(struct jbf_io *io, int fd)
+{
+    io->addr = mmap(NULL, io->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (io->addr == MAP_FAILED) {
+        return -1;
+    }
+
+    // with a memory budget, the file is read once in order and dropped
+    // behind the reader, which is kept open for dropping it from the page
+    // cache. Without one, pages stay around for rendering, which reads
+    // the file again, and for later requests to the daemon.
+    io->priv = (void *) (intptr_t) -1;
+    if (io->window != 0) {
+        madvise(io->addr, io->length, MADV_SEQUENTIAL);
+        io->priv = (void *) (intptr_t) dup(fd);
+    }
+    return 0;
+}
+
+static int mmap_wait(struct jbf_io *io, size_t end)
+{
+    // page faults do the work
+    return 0;
+}
+
+/* Unmap released pages, so that they no longer count towards our RSS.
+ * They are marked cold first, so that the page cache reclaims them before
+ * pages of other processes.
+ */
+static void mmap_release(struct jbf_io *io, size_t start, size_t end,
+                         int drop)
+{
+    int fd = (int) (intptr_t) io->priv;
+
+#ifdef MADV_COLD
+    madvise(&io->addr[start], end - start, MADV_COLD);
+#endif
+    madvise(&io->addr[start], end - start, MADV_DONTNEED);
+    if (drop && fd != -1) {
+        posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void mmap_close(struct jbf_io *io)
+{
+    int fd = (int) (intptr_t) io->priv;
+
+    munmap(io->addr, io->length);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/* io_uring backend. The file is read into an anonymous buffer in large
+ * chunks, keeping URING_DEPTH reads in flight ahead of the parser, so that
+ * slow storage is not accessed one page fault at a time. The buffer is
+ * registered with the kernel when possible to save the per-read page
+ * pinning.
+ */
+#define URING_CHUNK   (1024 * 1024)
+#define URING_DEPTH   32
+#define URING_REGMAX  (1024 * 1024 * 1024)  // kernel limit per buffer
+
+struct uring_io {
+    struct uring  ring;
+    int           fd;
+    int           fixed;    // buffer is registered
+    size_t        nchunks;
+    size_t        next;     // next chunk to submit
+    size_t        ready;    // number of leading chunks fully read
+    unsigned      inflight;
+    int           error;    // first failed read, -errno
+    uint32_t     *remain;   // bytes left to read, per chunk
+};
+
+static size_t uring_chunklen(struct jbf_io *io, size_t chunk)
+{
+    size_t start = chunk * URING_CHUNK;
+
+    if (io->length - start < URING_CHUNK) {
+        return io->length - start;
+    }
+    return URING_CHUNK;
+}
+
+static int uring_queue(struct jbf_io *io, size_t chunk)
+{
+    struct uring_io *uio = (struct uring_io *) io->priv;
+    struct io_uring_sqe *sqe;
+    size_t offset;
+
+    sqe = uring_get_sqe(&uio->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    // resume where a short read left off
+    offset = chunk * URING_CHUNK + uring_chunklen(io, chunk) -
+        uio->remain[chunk];
+
+    sqe->opcode    = uio->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd        = uio->fd;
+    sqe->off       = offset;
+    sqe->addr      = (uint64_t) (uintptr_t) &io->addr[offset];
+    sqe->len       = uio->remain[chunk];
+    sqe->buf_index = offset / URING_REGMAX;
+    sqe->user_data = chunk;
+    return 0;
+}
+
+static int uring_reap(struct jbf_io *io)
+{
+    struct uring_io *uio = (struct uring_io *) io->priv;
+    struct io_uring_cqe *cqe;
+    size_t chunk;
+    int res;
+    int rv = 0;
+
+    cqe = uring_wait_cqe(&uio->ring);
+    if (cqe == NULL) {
+        return -1;
+    }
+
+    do {
+        chunk = cqe->user_data;
+        res   = cqe->res;
+        uring_cqe_seen(&uio->ring);
+
+        if (res == -EAGAIN || res == -EINTR) {
+            // try again
+        }
+        else if (res <= 0) {
+            // read error, or file truncated under us
+            uio->inflight--;
+            if (uio->error == 0) {
+                uio->error = res < 0 ? res : -EIO;
+            }
+            rv = -1;
+            continue;
+        }
+        else {
+            uio->remain[chunk] -= res;
+        }
+
+        if (uio->remain[chunk] == 0) {
+            uio->inflight--;
+        }
+        else if (uring_queue(io, chunk) != 0) {
+            uio->inflight--;
+            rv = -1;
+        }
+    } while ((cqe = uring_peek_cqe(&uio->ring)) != NULL);
+
+    while (uio->ready < uio->nchunks &&
+           uio->remain[uio->ready] == 0)
+    {
+        uio->ready++;
+    }
+
+    return rv;
+}
 
-int jbf_open(char *filename, jbf_file **jbfp)
+static int uring_open(struct jbf_io *io, int fd)
 {
-    int fd;
-    struct stat stats;
+    struct uring_io *uio;
+    struct iovec *iov;
+    size_t nbufs;
+    size_t i;
     int ret;
-    int rv;
-    jbf_file *jbf = NULL;
-    struct mmap_info *mmap_info = NULL;
 
-    // allocate memory
-    jbf = (jbf_file *) malloc(sizeof(*jbf));
-    if (jbf == NULL) {
-        rv = JBFEMEM;
-        goto clean;
+    uio = (struct uring_io *) calloc(1, sizeof(*uio));
+    if (uio == NULL) {
+        return -1;
     }
-    memset(jbf, 0, sizeof(*jbf));
+    uio->fd = -1;
+    io->priv = uio;
+    io->addr = MAP_FAILED;
 
-    mmap_info = (struct mmap_info *) malloc(sizeof(*mmap_info));
-    if (mmap_info == NULL) {
-        rv = JBFEMEM;
-        goto clean;
+    ret = uring_init(&uio->ring, URING_DEPTH);
+    if (ret != 0) {
+        free(uio);
+        io->priv = NULL;
+        return -1;
     }
-    memset(mmap_info, 0, sizeof(*mmap_info));
-    mmap_info->addr = MAP_FAILED;
-
-    jbf->_handle = (void *) mmap_info;
 
-    // open file
-    fd = open(filename, O_RDONLY);
-    if (fd == -1) {
-        rv = JBFEARGS;
+    uio->fd = dup(fd);
+    uio->nchunks = (io->length + URING_CHUNK - 1) / URING_CHUNK;
+    uio->remain = (uint32_t *) malloc(uio->nchunks * sizeof(uint32_t));
+    io->addr = mmap(NULL, io->length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uio->fd == -1 ||
+        uio->remain == NULL ||
+        io->addr == MAP_FAILED)
+    {
         goto clean;
     }
 
-    // find file size
-    ret = fstat(fd, &stats);
-    if (ret != 0) {
-        close(fd);
-        rv = JBFEARGS;
-        goto clean;
+    for (i = 0; i < uio->nchunks; i++) {
+        uio->remain[i] = uring_chunklen(io, i);
     }
-    mmap_info->length = stats.st_size;
 
-    // jbf header needs to be at least 0x400 bytes long
-    if (mmap_info->length < 0x400) {
-        close(fd);
-        rv = JBFECORRUPT;
-        goto clean;
+    // register the buffer; reads still work if this fails, e.g. due to
+    // RLIMIT_MEMLOCK, they just cost a little more
+    nbufs = (io->length + URING_REGMAX - 1) / URING_REGMAX;
+    iov = (struct iovec *) malloc(nbufs * sizeof(*iov));
+    if (iov != NULL) {
+        for (i = 0; i < nbufs; i++) {
+            iov[i].iov_base = &io->addr[i * URING_REGMAX];
+            iov[i].iov_len  = io->length - i * URING_REGMAX;
+            if (iov[i].iov_len > URING_REGMAX) {
+                iov[i].iov_len = URING_REGMAX;
+            }
+        }
+        uio->fixed = uring_register_buffers(&uio->ring, iov, nbufs) == 0;
+        free(iov);
     }
 
-    // mmap the file
-    mmap_info->addr = mmap(NULL, mmap_info->length, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
-    if (mmap_info->addr == MAP_FAILED) {
-        rv = JBFEMEM;
+    // kernels before 5.6 set up the ring but have no IORING_OP_READ; the
+    // first read tells, and mmap is used instead
+    if (uring_wait(io, 1) != 0 &&
+        (uio->error == -EINVAL || uio->error == -EOPNOTSUPP))
+    {
         goto clean;
     }
 
-    // parse file
-    ret = parse_jbf(jbf, mmap_info);
-    if (ret != 0) {
-        rv = JBFECORRUPT;
-        goto clean;
+    return 0;
+
+ clean:
+    uring_close(io);
+    return -1;
+}
+
+static int uring_wait(struct jbf_io *io, size_t end)
+{
+    struct uring_io *uio = (struct uring_io *) io->priv;
+
+    // a chunk that failed is not read again
+    if (uio->error != 0) {
+        return -1;
     }
 
-    // success
-    *jbfp = jbf;
-    return JBFSUCCESS;
+    while (uio->ready < uio->nchunks &&
+           uio->ready * URING_CHUNK < end)
+    {
+        // keep the queue full
+        while (uio->inflight < URING_DEPTH &&
+               uio->next < uio->nchunks &&
+               uring_queue(io, uio->next) == 0)
+        {
+            uio->next++;
+            uio->inflight++;
+        }
+        if (uring_submit(&uio->ring, 0) < 0) {
+            return -1;
+        }
+        if (uring_reap(io) != 0) {
+            return -1;
+        }
+    }
 
- clean:
-    jbf_close(jbf);
-    return rv;
+    // everything is in memory, the ring is no longer needed
+    if (uio->ready == uio->nchunks &&
+        uio->ring.fd >= 0)
+    {
+        uring_exit(&uio->ring);
+        close(uio->fd);
+        uio->fd = -1;
+    }
+
+    return 0;
 }
 
-int jbf_close(jbf_file *jbf)
+static void uring_close(struct jbf_io *io)
 {
-    if (jbf != NULL) {
-        struct mmap_info *mmap_info = (struct mmap_info *) jbf->_handle;
-        if (mmap_info != NULL &&
-            mmap_info->addr != MAP_FAILED)
+    struct uring_io *uio = (struct uring_io *) io->priv;
+    unsigned inflight;
+
+    if (uio != NULL) {
+        // the kernel may still be writing into the buffer; failed reads
+        // are reaped too, until nothing completes any more
+        while (uio->inflight > 0 &&
+               uio->ring.fd >= 0)
         {
-            munmap(mmap_info->addr, mmap_info->length);
+            inflight = uio->inflight;
+            if (uring_reap(io) != 0 && uio->inflight == inflight) {
+                break;
+            }
         }
-        free_jbf(jbf);
-        free(jbf);
-        free(mmap_info);
+        if (uio->ring.fd >= 0) {
+            uring_exit(&uio->ring);
+        }
+        if (uio->fd != -1) {
+            close(uio->fd);
+        }
+        free(uio->remain);
+        free(uio);
+        io->priv = NULL;
+    }
+    if (io->addr != MAP_FAILED) {
+        munmap(io->addr, io->length);
     }
-    return JBFSUCCESS;
 }
 
-static int parse_jbf(jbf_file *jbf, struct mmap_info *mmap_info)
+static int parse_jbf(jbf_file *jbf, struct jbf_io *io, jbf_options *opts)
 {
     struct filehdr *hdr;
-    uint32_t offset;
+    size_t offset;
+    size_t next;
+    size_t size;
     int ret;
     uint32_t count = 0;
+    uint32_t allocated;
+    uint32_t recover = opts != NULL && (opts->flags & JBFOPT_RECOVER);
+    uint32_t threads = opts != NULL ? opts->threads : 1;
     jbf_entry *entries = NULL;
-    uint8_t *addr = mmap_info->addr;
+    uint8_t *addr = io->addr;
+
+    if (io_wait(io, 0x400) != 0) {
+        goto clean;
+    }
 
     hdr = (struct filehdr *) addr;
 
@@ -177,33 +1204,102 @@ static int parse_jbf(jbf_file *jbf, struct mmap_info *mmap_info)
         goto clean;
     }
 
+    // when recovering, the entry count can not be trusted; entries are
+    // read until the end of the file
     count = le32toh(hdr->count);
-    entries = (jbf_entry *) calloc(count, sizeof(jbf_entry));
+    allocated = count;
+    if (recover) {
+        if (allocated > (io->length - 0x400) / 40) {
+            allocated = (io->length - 0x400) / 40;
+        }
+        if (allocated == 0) {
+            allocated = 1;
+        }
+        // the scan for entries needs the whole file
+        if (io_wait(io, io->length) != 0) {
+            goto clean;
+        }
+    }
+    entries = (jbf_entry *) calloc(allocated, sizeof(jbf_entry));
 
     if (entries == NULL) {
         goto clean;
     }
 
     jbf->entries = entries;
-    jbf->dirname = strndup((char *) &addr[23], 0x400);
+    jbf->dirname = strndup((char *) &addr[23], 0x400 - 23);
+
+    // extract thumbnails, in parallel if possible. The parallel parser
+    // touches the whole file at once, so it is not used with a memory
+    // budget.
+    if (!recover &&
+        threads > 1 &&
+        io->window == 0 &&
+        parse_parallel(jbf, io, count, threads) == 0)
+    {
+        io->parsed = jbf->entrycount;
+        return 0;
+    }
+
+    // streamed: entries are parsed, and their thumbnails read, as they
+    // are fetched
+    if (!recover &&
+        opts != NULL && (opts->flags & JBFOPT_STREAM))
+    {
+        jbf->entrycount = count;
+        io->next = 0x400;
+        io->parsed = 0;
+        return 0;
+    }
 
-    // extract thumbnails
     offset = 0x400;
-    for (jbf->entrycount = 0; jbf->entrycount < count; jbf->entrycount++) {
-        ret = parse_entry(&addr[offset], &entries[jbf->entrycount]);
-        if (ret <= 0) {
-            goto clean;
+    jbf->entrycount = 0;
+    while (recover ? offset < io->length : jbf->entrycount < count) {
+        if (jbf->entrycount == allocated) {
+            allocated *= 2;
+            entries = (jbf_entry *) realloc(entries,
+                                            allocated * sizeof(jbf_entry));
+            if (entries == NULL) {
+                goto clean;
+            }
+            jbf->entries = entries;
+        }
+        memset(&entries[jbf->entrycount], 0, sizeof(jbf_entry));
+
+        ret = parse_entry(io, offset, &entries[jbf->entrycount], &size);
+        if (ret == 0 &&
+            (!recover || plausible_entry(&entries[jbf->entrycount])))
+        {
+            jbf->entrycount++;
+            offset += size;
+            io_release(io, offset, 0);
+            continue;
         }
-        offset += ret;
 
-        if (offset > mmap_info->length) {
+        if (!recover) {
             goto clean;
         }
+
+        // skip to the next entry that looks right
+        free_entry(&entries[jbf->entrycount]);
+        next = find_entry(io, offset + 1, io->length);
+        jbf->skipcount++;
+        jbf->skipbytes += next - offset;
+        offset = next;
+    }
+
+    // make sure all thumbnail data is in memory
+    if (io_wait(io, offset) != 0) {
+        goto clean;
     }
 
+    // rendering reads the file again from the start
+    io->released = 0;
+    io->parsed = jbf->entrycount;
+
 #ifdef DEBUG
     printf("%d entries parsed, %d expected\n", jbf->entrycount, count);
-    printf("offset=0x%08x, length=0x%08zx\n", offset, mmap_info->length);
+    printf("offset=0x%08zx, length=0x%08zx\n", offset, io->length);
 #endif
 
     return 0;
@@ -213,6 +1309,382 @@ static int parse_jbf(jbf_file *jbf, struct mmap_info *mmap_info)
     return -1;
 }
 
+/* Sanity checks on an entry, beyond what parse_entry() does, for finding
+ * entries in corrupt files: file names are printable, and file types are
+ * within the known range.
+ */
+static int plausible_entry(jbf_entry *entry)
+{
+    uint32_t i;
+
+    if (entry->filenamelength == 0 ||
+        entry->filetype > JbfFiletypeE_rgb)
+    {
+        return 0;
+    }
+    for (i = 0; i < entry->filenamelength; i++) {
+        if ((uint8_t) entry->filename[i] < 0x20 ||
+            entry->filename[i] == 0x7f)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Find the first offset in [from, end) where a thumbnail header ends:
+ * thumbmagic, followed by thumbsize, followed by a JPEG SOI marker.
+ *
+ * Returns end if there is none.
+ */
+static size_t scan_thumbmagic(const uint8_t *data, size_t from, size_t end)
+{
+    size_t x = from;
+
+    if (end - from < 10 || end < 10) {
+        return end;
+    }
+
+#ifdef __SSE2__
+    {
+        const __m128i ff = _mm_set1_epi8((char) 0xff);
+        const __m128i d8 = _mm_set1_epi8((char) 0xd8);
+        __m128i m;
+        unsigned mask;
+
+        // compare 16 candidate positions at a time on the first and last
+        // byte of thumbmagic and the SOI marker, then check the rest
+        for (; x + 16 + 9 <= end; x += 16) {
+            m = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) &data[x]), ff),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) &data[x + 3]), ff)),
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) &data[x + 8]), ff),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) &data[x + 9]), d8)));
+            mask = _mm_movemask_epi8(m);
+            while (mask) {
+                size_t i = x + __builtin_ctz(mask);
+                if (data[i + 1] == 0xff && data[i + 2] == 0xff) {
+                    return i;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    for (; x + 10 <= end; x++) {
+        if (data[x] == 0xff && data[x + 1] == 0xff &&
+            data[x + 2] == 0xff && data[x + 3] == 0xff &&
+            data[x + 8] == 0xff && data[x + 9] == 0xd8)
+        {
+            return x;
+        }
+    }
+    return end;
+}
+
+/* Find the start of the first entry in [from, end) that has a thumbnail
+ * and looks right. The thumbnail header is found by scanning, and the file
+ * name length and header are checked backwards from there.
+ *
+ * Returns io->length if there is none.
+ */
+static size_t find_entry(struct jbf_io *io, size_t from, size_t end)
+{
+    const size_t magicoffset = offsetof(struct entryhdr, thumbmagic);
+    uint8_t *data = io->addr;
+    size_t x = from + 4 + magicoffset;
+    size_t scanend = end + 4 + 255 + magicoffset + 10;
+    size_t hdroffset;
+    size_t start;
+    uint32_t filenamelength;
+    uint32_t i;
+    struct entryhdr *hdr;
+
+    if (scanend > io->length) {
+        scanend = io->length;
+    }
+
+    while ((x = scan_thumbmagic(data, x, scanend)) < scanend) {
+        hdroffset = x - magicoffset;
+        hdr = (struct entryhdr *) &data[hdroffset];
+
+        if (le32toh(hdr->filetype) <= JbfFiletypeE_rgb &&
+            hdroffset + sizeof(*hdr) + le32toh(hdr->thumbsize) <= io->length)
+        {
+            for (filenamelength = 1;
+                 filenamelength <= 255 && hdroffset >= from + 4 + filenamelength;
+                 filenamelength++)
+            {
+                start = hdroffset - filenamelength - 4;
+                if (le32toh(*(uint32_t *) &data[start]) != filenamelength) {
+                    continue;
+                }
+                for (i = 0; i < filenamelength; i++) {
+                    if (data[start + 4 + i] < 0x20 ||
+                        data[start + 4 + i] == 0x7f)
+                    {
+                        break;
+                    }
+                }
+                if (i == filenamelength && start < end) {
+                    return start;
+                }
+            }
+        }
+        x++;
+    }
+    return io->length;
+}
+
+/* Parallel parser. Entry boundaries are only known by walking the chain of
+ * entries from the start of the file, so this speculates: the file is
+ * split into one chunk per thread, and each thread guesses where the first
+ * entry in its chunk starts using find_entry(), and walks the chain from
+ * there to the end of its chunk. The chains are then stitched together
+ * from the start of the file. Where the true chain reaches a chunk at an
+ * offset the chunk's thread also reached, the chains are identical from
+ * there on; where it does not, the chunk is walked again sequentially. The
+ * result is always the same as that of the sequential parser. Finally,
+ * the entries are parsed in parallel.
+ */
+#define PARALLEL_MINCHUNK (4 * 1024 * 1024)
+
+struct chain {
+    struct jbf_io *io;
+    size_t        start;      // chunk bounds
+    size_t        end;
+    int           exact;      // start is known to be an entry
+    size_t       *offsets;    // entries found
+    size_t        count;
+    size_t        allocated;
+    size_t        next;       // offset after the last entry found
+    int           failed;
+};
+
+struct entryrange {
+    struct jbf_io *io;
+    jbf_entry    *entries;
+    size_t       *offsets;
+    uint32_t      first;
+    uint32_t      last;
+    int           failed;
+};
+
+static int chain_push(size_t **offsets, size_t *count, size_t *allocated,
+                      size_t offset)
+{
+    size_t *p;
+
+    if (*count == *allocated) {
+        *allocated = *allocated ? *allocated * 2 : 1024;
+        p = (size_t *) realloc(*offsets, *allocated * sizeof(size_t));
+        if (p == NULL) {
+            return -1;
+        }
+        *offsets = p;
+    }
+    (*offsets)[(*count)++] = offset;
+    return 0;
+}
+
+static void *chain_walk(void *arg)
+{
+    struct chain *c = (struct chain *) arg;
+    size_t offset;
+    size_t size;
+
+    offset = c->exact ? c->start : find_entry(c->io, c->start, c->end);
+    while (offset < c->end) {
+        if (parse_entry(c->io, offset, NULL, &size) != 0) {
+            break;
+        }
+        if (chain_push(&c->offsets, &c->count, &c->allocated, offset) != 0) {
+            c->failed = 1;
+            break;
+        }
+        offset += size;
+    }
+    c->next = offset;
+    return NULL;
+}
+
+static void *entryrange_parse(void *arg)
+{
+    struct entryrange *r = (struct entryrange *) arg;
+    size_t size;
+    uint32_t i;
+
+    for (i = r->first; i < r->last; i++) {
+        if (parse_entry(r->io, r->offsets[i], &r->entries[i], &size) != 0) {
+            r->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int parse_parallel(jbf_file *jbf, struct jbf_io *io, uint32_t count,
+                          uint32_t threads)
+{
+    struct chain *chains = NULL;
+    struct entryrange *ranges = NULL;
+    pthread_t *tids = NULL;
+    size_t *offsets = NULL;
+    size_t total = 0;
+    size_t allocated = 0;
+    size_t chunk;
+    size_t cur;
+    size_t size;
+    size_t lo;
+    size_t hi;
+    uint32_t t;
+    uint32_t started = 0;
+    int rv = -1;
+
+    if ((io->length - 0x400) / threads < PARALLEL_MINCHUNK) {
+        threads = (io->length - 0x400) / PARALLEL_MINCHUNK;
+    }
+    if (threads < 2 || count == 0) {
+        return -1;
+    }
+
+    // the file must be in memory before threads touch it
+    if (io_wait(io, io->length) != 0) {
+        return -1;
+    }
+
+    chains = (struct chain *) calloc(threads, sizeof(*chains));
+    ranges = (struct entryrange *) calloc(threads, sizeof(*ranges));
+    tids   = (pthread_t *) calloc(threads, sizeof(*tids));
+    if (chains == NULL || ranges == NULL || tids == NULL) {
+        goto clean;
+    }
+
+    // walk the chain in each chunk
+    chunk = (io->length - 0x400) / threads;
+    for (t = 0; t < threads; t++) {
+        chains[t].io    = io;
+        chains[t].start = 0x400 + t * chunk;
+        chains[t].end   = t == threads - 1 ? io->length : 0x400 + (t + 1) * chunk;
+        chains[t].exact = t == 0;
+    }
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, chain_walk,
+                           &chains[started]) != 0)
+        {
+            break;
+        }
+    }
+    for (t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    if (started < threads) {
+        goto clean;
+    }
+
+    // stitch the chains together
+    cur = 0x400;
+    for (t = 0; t < threads && total < count; t++) {
+        struct chain *c = &chains[t];
+
+        if (c->failed) {
+            goto clean;
+        }
+
+        lo = 0;
+        hi = c->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (c->offsets[mid] < cur) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+
+        if (lo < c->count && c->offsets[lo] == cur) {
+            // the chains meet
+            for (; lo < c->count && total < count; lo++) {
+                if (chain_push(&offsets, &total, &allocated,
+                               c->offsets[lo]) != 0)
+                {
+                    goto clean;
+                }
+            }
+            cur = c->next;
+        }
+        else {
+            // bad guess, walk this chunk again
+            while (cur < c->end && total < count) {
+                if (parse_entry(io, cur, NULL, &size) != 0 ||
+                    chain_push(&offsets, &total, &allocated, cur) != 0)
+                {
+                    goto clean;
+                }
+                cur += size;
+            }
+        }
+    }
+    if (total < count) {
+        goto clean;
+    }
+
+    // parse entries
+    for (t = 0; t < threads; t++) {
+        ranges[t].io      = io;
+        ranges[t].entries = jbf->entries;
+        ranges[t].offsets = offsets;
+        ranges[t].first   = (uint64_t) count * t / threads;
+        ranges[t].last    = (uint64_t) count * (t + 1) / threads;
+    }
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, entryrange_parse,
+                           &ranges[started]) != 0)
+        {
+            break;
+        }
+    }
+    for (t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    jbf->entrycount = count;
+
+    if (started < threads) {
+        goto clean;
+    }
+    for (t = 0; t < threads; t++) {
+        if (ranges[t].failed) {
+            goto clean;
+        }
+    }
+
+    rv = 0;
+
+ clean:
+    if (rv != 0 && jbf->entrycount != 0) {
+        // leave the entries as the sequential parser expects them
+        for (t = 0; t < count; t++) {
+            free_entry(&jbf->entries[t]);
+        }
+        memset(jbf->entries, 0, count * sizeof(jbf_entry));
+        jbf->entrycount = 0;
+    }
+    if (chains != NULL) {
+        for (t = 0; t < threads; t++) {
+            free(chains[t].offsets);
+        }
+    }
+    free(chains);
+    free(ranges);
+    free(tids);
+    free(offsets);
+    return rv;
+}
+
 static void free_jbf(jbf_file *jbf)
 {
     int i;
@@ -270,10 +1742,29 @@ static void dump_entry(uint8_t *data)
 }
 #endif
 
-static int parse_entry(uint8_t *data, jbf_entry *entry)
+/* Parse the entry at offset into entry, and return its size in the file
+ * in *size. If entry is NULL, only the size is found.
+ */
+static int parse_entry(struct jbf_io *io, size_t offset, jbf_entry *entry,
+                       size_t *size)
 {
     struct entryhdr *hdr;
     uint32_t filenamelength;
+    uint8_t *data = &io->addr[offset];
+    size_t hdroffset;
+    jbf_entry scratch;
+    int keepname = entry != NULL;
+    int ret;
+
+    if (entry == NULL) {
+        memset(&scratch, 0, sizeof(scratch));
+        entry = &scratch;
+    }
+
+    // file name length, and the header up to and including data1[0]
+    if (io_wait(io, offset + 4) != 0) {
+        goto clean;
+    }
 
 #ifdef DEBUG
     dump_entry(data);
@@ -285,11 +1776,25 @@ static int parse_entry(uint8_t *data, jbf_entry *entry)
         goto clean;
     }
 
+    hdroffset = offset + 4 + filenamelength;
+    if (io_wait(io, hdroffset + 36) != 0) {
+        goto clean;
+    }
     hdr = (struct entryhdr *) &data[4 + filenamelength];
 
+    // the name is used as a string of filenamelength bytes
+    if (memchr(&data[4], '\0', filenamelength) != NULL) {
+        goto clean;
+    }
+
     // prepare entry
     entry->filenamelength = filenamelength;
-    entry->filename = strndup((char *) &data[4], filenamelength);
+    if (keepname) {
+        entry->filename = strndup((char *) &data[4], filenamelength);
+        if (entry->filename == NULL) {
+            goto clean;
+        }
+    }
     entry->filetime = le64toh(hdr->filetime);
     entry->filetype = le32toh(hdr->filetype);
     entry->width    = le32toh(hdr->width);
@@ -297,14 +1802,22 @@ static int parse_entry(uint8_t *data, jbf_entry *entry)
     entry->bpp      = le32toh(hdr->bpp);
     entry->bufsize  = le32toh(hdr->bufsize);
     entry->filesize = le32toh(hdr->filesize);
+    entry->data1[0] = le32toh(hdr->data1[0]);
 
-    if (hdr->thumbmagic != THUMB_MAGIC) {
+    // a header that would end past the end of the file is taken as an
+    // entry without thumbnail, but a failed read is not
+    ret = io_wait(io, hdroffset + sizeof(struct entryhdr) + 2);
+    if (ret < 0) {
+        goto clean;
+    }
+    if (ret > 0 || hdr->thumbmagic != THUMB_MAGIC) {
         // entry without thumbnail, happens with raw files
         entry->thumbnail.size = 0;
         entry->thumbnail.data = NULL;
-        return 4 +
+        *size = 4 +
             entry->filenamelength +
             36;
+        return 0;
     }
 
     // check for SOI marker
@@ -314,19 +1827,65 @@ static int parse_entry(uint8_t *data, jbf_entry *entry)
             goto clean;
     }
 
+    entry->data1[1] = le32toh(hdr->data1[1]);
     entry->thumbnail.size = le32toh(hdr->thumbsize);
     entry->thumbnail.data = hdr->jpghdr;
 
-    return 4 +                     // file name length
+    *size = 4 +                    // file name length
         entry->filenamelength +    // file name
         sizeof(struct entryhdr) +  // header size
         entry->thumbnail.size;     // thumbnail data
 
+    if (offset + *size > io->length) {
+        goto clean;
+    }
+
+    return 0;
+
  clean:
     free_entry(entry);
     return -1;
 }
 
+static int write_entry(FILE *out, jbf_entry *entry)
+{
+    struct entryhdr hdr;
+    uint32_t filenamelength;
+    size_t hdrsize;
+
+    if (entry->filenamelength > 255) {
+        return JBFEARGS;
+    }
+
+    hdr.filetime   = htole64(entry->filetime);
+    hdr.filetype   = htole32(entry->filetype);
+    hdr.width      = htole32(entry->width);
+    hdr.height     = htole32(entry->height);
+    hdr.bpp        = htole32(entry->bpp);
+    hdr.bufsize    = htole32(entry->bufsize);
+    hdr.filesize   = htole32(entry->filesize);
+    hdr.data1[0]   = htole32(entry->data1[0]);
+    hdr.data1[1]   = htole32(entry->data1[1]);
+    hdr.thumbmagic = THUMB_MAGIC;
+    hdr.thumbsize  = htole32(entry->thumbnail.size);
+
+    // entries without thumbnail end after data1[0]
+    hdrsize = entry->thumbnail.data != NULL ? sizeof(hdr) : 36;
+
+    filenamelength = htole32(entry->filenamelength);
+    if (fwrite(&filenamelength, 4, 1, out) != 1 ||
+        fwrite(entry->filename, 1, entry->filenamelength, out) !=
+            entry->filenamelength ||
+        fwrite(&hdr, hdrsize, 1, out) != 1 ||
+        fwrite(entry->thumbnail.data, 1, entry->thumbnail.size, out) !=
+            entry->thumbnail.size)
+    {
+        return JBFEIO;
+    }
+
+    return JBFSUCCESS;
+}
+
 static void free_entry(jbf_entry *entry)
 {
     if (entry) {
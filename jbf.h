@@ -32,6 +32,7 @@
 #define JBFEARGS      -1
 #define JBFEMEM       -2
 #define JBFECORRUPT   -3
+#define JBFEIO        -4
 
 typedef enum {
     JbfFiletypeE_raw  = 0x00,
@@ -78,20 +79,67 @@ typedef struct {
     uint32_t      bpp;
     uint32_t      bufsize;
     uint32_t      filesize;
+    uint32_t      data1[2];
+    uint32_t      status;     // JBFSTAT_* flags, set by jbf_check
     struct {
         uint32_t  size;
         uint8_t  *data;
     }             thumbnail;
 } jbf_entry;
 
+// filetime is a Win32 FILETIME: 100 ns ticks since 1601-01-01
+#define TICKS_PER_SECOND  10000000
+#define EPOCH_DIFFERENCE  11644473600LL  // seconds from 1601 to 1970
+
+// jbf_entry status flags
+#define JBFSTAT_MISSING   0x00000001  // no regular file by that name
+#define JBFSTAT_FILESIZE  0x00000002  // file size differs from the entry
+#define JBFSTAT_FILETIME  0x00000004  // file time differs from the entry
+
 typedef struct {
     uint32_t      entrycount;
     char         *dirname;
     jbf_entry    *entries;
+    uint32_t      skipcount;  // corrupt regions skipped, JBFOPT_RECOVER
+    uint64_t      skipbytes;
     void        *_handle;
 } jbf_file;
 
+// jbf_options flags
+#define JBFOPT_URING    0x00000001  // read the file with io_uring, not mmap
+#define JBFOPT_RECOVER  0x00000002  // skip corrupt entries rather than fail
+#define JBFOPT_STREAM   0x00000004  // parse entries as jbf_fetch asks for
+                                    // them, so that reading the file
+                                    // overlaps their use
+
+typedef struct {
+    uint32_t      flags;
+    uint32_t      threads;    // parser threads, 0 or 1 to parse sequentially
+    uint64_t      budget;     // bytes of the file to keep in memory while
+                              // it is read in order, 0 for no limit
+} jbf_options;
+
+// jbf_diff changes
+#define JBFDIFF_ADDED      0x00000001
+#define JBFDIFF_REMOVED    0x00000002
+#define JBFDIFF_FILETIME   0x00000004
+#define JBFDIFF_FILESIZE   0x00000008
+#define JBFDIFF_THUMBNAIL  0x00000010
+
+// called by jbf_diff; old is NULL for added and new for removed entries
+typedef void (*jbf_diff_report)(void *arg, uint32_t changes,
+                                jbf_entry *old, jbf_entry *new);
+
 int jbf_open(char *filename, jbf_file **jbf);
+int jbf_open_opts(char *filename, jbf_options *opts, jbf_file **jbf);
 int jbf_close(jbf_file *jbf);
+int jbf_fetch(jbf_file *jbf, uint32_t index);
+int jbf_release(jbf_file *jbf, jbf_entry *entry);
+int jbf_write(jbf_file *jbf, char *filename);
+int jbf_compact(jbf_file *jbf, char *imagedir, uint32_t *missing,
+                uint32_t *duplicates);
+int jbf_check(jbf_file *jbf, char *imagedir);
+int jbf_diff(jbf_file *old, jbf_file *new, jbf_diff_report report,
+             void *arg);
 
 #endif // _JBF_H
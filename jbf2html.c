@@ -23,24 +23,203 @@
  * SOFTWARE.
  *
  ***************************************************************************/
+#define _GNU_SOURCE         // fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "jbf.h"
 #include "base64.h"
+#include "daemon.h"
+#include "escape.h"
+#include "jpeg.h"
+#include "search.h"
+#include "template.h"
 
+// entries left out of the page
+#define SKIP_ZERO_THUMBS  0x00000001
+#define SKIP_MISSING      0x00000002
+
+// optional style sheets
+#define CSS_VIRTUAL       0x00000001
+#define CSS_SEARCH        0x00000002
+#define CSS_CHECK         0x00000004
+
+// parallel output: entries per unit of work, and buffer per thread
+#define WRITE_CHUNK       256
+#define WRITE_BUFFER      (1024 * 1024)
+
+struct diffreport {
+    FILE     *out;
+    int       json;
+    uint32_t  added;
+    uint32_t  removed;
+    uint32_t  changed;
+};
+
+/* Markup of an entry in the built-in layout, around its thumbnail data:
+ * headlen bytes before the data, and length - headlen after it.
+ */
+struct markup {
+    char     *buf;
+    size_t    size;
+    size_t    headlen;
+    size_t    length;
+};
+
+/* Entries written by a pool of threads, in two passes: the first sets
+ * offsets[i + 1] to the size of entry i, the second writes each entry at
+ * offsets[i] once they have been summed up.
+ */
+struct writepool {
+    jbf_file     *jbf;
+    uint32_t     *order;         // entries in the page
+    uint64_t     *offsets;       // count + 1 offsets in the output file
+    jpeg_info    *infos;         // thumbnails, parsed in the first pass
+    uint8_t      *hasinfo;       // infos[i] is valid
+    uint32_t      count;
+    uint32_t      placeholders;
+    int           fd;
+    int           plan;          // first pass
+    uint32_t      next;          // next chunk of WRITE_CHUNK entries
+    int           failed;        // set by any thread, atomically
+};
+
+/* Output of one thread, written with pwrite at pos when the buffer fills
+ * up.
+ */
+struct writebuf {
+    int           fd;
+    char         *data;
+    size_t        used;
+    uint64_t      pos;
+};
+
+static const struct {
+    uint32_t    change;
+    const char *name;
+} diffields[] = {
+    { JBFDIFF_FILETIME,  "filetime" },
+    { JBFDIFF_FILESIZE,  "filesize" },
+    { JBFDIFF_THUMBNAIL, "thumbnail" },
+};
+
+typedef enum {
+    TemplateFieldE_filename,
+    TemplateFieldE_width,
+    TemplateFieldE_height,
+    TemplateFieldE_bpp,
+    TemplateFieldE_filesize,
+    TemplateFieldE_filetype,
+    TemplateFieldE_filetime,
+    TemplateFieldE_thumb,
+    TemplateFieldE_imgattr,
+    TemplateFieldE_css,
+    TemplateFieldE_status,
+    TemplateFieldE_url,
+}   TemplateFieldE;
+
+// placeholder names, in TemplateFieldE order
+static const char *const templatefields[] = {
+    "filename",
+    "width",
+    "height",
+    "bpp",
+    "filesize",
+    "filetype",
+    "filetime",
+    "thumb",
+    "imgattr",
+    "css",
+    "status",
+    "url",
+    NULL
+};
+
+/* Settings and streams for one conversion, from the command line or a
+ * daemon request.
+ */
+struct job {
+    char         *infile;
+    char         *outfile;
+    char         *oldfile;
+    char         *imagedir;
+    char         *socket;        // -D, run as daemon
+    const char   *cwd;           // client directory, for daemon requests
+    uint32_t      skip;
+    uint32_t      css;
+    uint32_t      compact;
+    uint32_t      placeholders;
+    uint32_t      virtual;
+    uint32_t      search;
+    uint32_t      json;
+    uint32_t      writers;       // -w, threads writing the html
+    jbf_options   jbfopts;
+    template     *tpl;
+    FILE         *out;           // stdout, or the client's
+    FILE         *err;           // stderr, or the client's
+};
+
+static void initjob(struct job *job, const char *cwd, FILE *out, FILE *err);
+static void freejob(struct job *job);
+static char *jobpath(struct job *job, const char *path);
+static int parseargs(struct job *job, int argc, char *argv[]);
+static int handlerequest(const char *cwd, int argc, char **argv,
+                         FILE *out, FILE *err);
+static int jobchecks(struct job *job);
+static int jobopen(struct job *job, char *filename, jbf_file **jbf);
+static void jobclose(struct job *job, jbf_file *jbf);
+static int runjob(struct job *job);
+static int openjbf(struct job *job, char *infile, int cwd, jbf_file **jbf,
+                   char **path);
+static void reportchange(void *arg, uint32_t changes, jbf_entry *old,
+                         jbf_entry *new);
+static void releaseoutput(FILE *out, off_t *released, off_t window);
 static void printcss(FILE *out);
-static void printentry(FILE *out, jbf_entry *entry);
+static void printvirtualcss(FILE *out);
+static void printsearchcss(FILE *out);
+static int printvirtual(FILE *out, FILE *err, char *outfile, jbf_file *jbf,
+                        uint32_t skip, search_index *index);
+static void removestale(const char *thumbpath, uint32_t count);
+static void printsearch(FILE *out, FILE *msg, search_index *index,
+                        jbf_file *jbf, uint32_t skip, uint32_t virtual);
+static void printjson(FILE *out, const char *str);
+static int formatentry(struct markup *m, jbf_entry *entry,
+                       const jpeg_info *info);
+static int printentry(FILE *out, jbf_entry *entry, uint32_t placeholders,
+                      struct markup *m);
+static int printparallel(FILE *out, FILE *err, jbf_file *jbf, uint32_t skip,
+                         uint32_t placeholders, uint32_t threads,
+                         search_index *index);
+static int printtemplate(FILE *out, template_part *part, jbf_entry *entry,
+                         uint32_t placeholders, uint32_t css);
+static void printpagecss(FILE *out, uint32_t css);
+static void printcheckcss(FILE *out);
+static int skipentry(jbf_entry *entry, uint32_t skip);
+static const char *statusS(jbf_entry *entry);
 static const char *JbfFiletypeES(jbf_entry *entry);
 static const char *BppS(jbf_entry *entry);
 static char *filetimeS(jbf_entry *entry);
 static char *filesizeS(jbf_entry *entry);
+static const jpeg_info *thumbinfo(jbf_entry *entry, uint32_t color,
+                                  jpeg_info *info);
+static void imgattrS(const jpeg_info *info, char *buf, size_t size);
 
-static void printhelp(void)
+static void printhelp(FILE *out)
 {
-    printf("jbf2html [-h|-z|-o <file>] input\n"
+    fprintf(out,"jbf2html [-h|-z|-u|-r|-c|-p|-v|-s|-j <n>|-w <n>|-m <MiB>|\n"
+           "          -d <old>|-f <fmt>|-x <what>|-b <dir>|-t <file>|\n"
+           "          -o <file>] input\n"
+           "jbf2html -D <socket>\n"
+           "jbf2html -C <socket> [options] input\n"
            "\n"
            "Transforms Paint Shop Pro 7 jbf files to complete html pages\n"
            "with embedded thumbnails.\n"
@@ -48,8 +227,48 @@ static void printhelp(void)
            " -h          show this help\n"
            " -z          include entries with 0-byte thumbnails\n"
            "             (skipped by default)\n"
+           " -u          read the jbf file with io_uring rather than mmap\n"
+           "             (faster on slow or network storage)\n"
+           " -r          recover from corrupt jbf files: skip damaged\n"
+           "             entries rather than failing\n"
+           " -j <n>      use <n> threads to parse the jbf file\n"
+           " -w <n>      use <n> threads to write the html, each writing\n"
+           "             its entries where they go in the output file.\n"
+           "             Ignored with -t, -v or -m, or if the output is not\n"
+           "             a regular file.\n"
+           " -m <MiB>    keep memory use around <MiB> MiB, whatever the\n"
+           "             size of the jbf file\n"
+           " -p          give thumbnails a placeholder color, shown until\n"
+           "             they have been decoded by the browser\n"
+           " -v          virtual scrolling: only the thumbnails in view are\n"
+           "             in the page at any time, for large collections.\n"
+           "             Thumbnails are written to a directory next to the\n"
+           "             output file.\n"
+           " -s          add a search box that filters thumbnails by\n"
+           "             file name, using an index built into the page\n"
+           " -c          compact the jbf file instead of creating html:\n"
+           "             drop entries for images that no longer exist\n"
+           "             and duplicate entries. The jbf file is replaced\n"
+           "             unless -o is given.\n"
+           " -d <old>    report entries added, removed or changed since\n"
+           "             the jbf file <old> instead of creating html\n"
+           " -f <fmt>    format of the -d report, text (default) or json\n"
+           " -x <what>   check that the image files exist: mark or skip\n"
+           "             entries for missing images, and mark entries for\n"
+           "             images changed since their thumbnail was made\n"
+           " -b <dir>    directory of the image files, for -x and -c.\n"
+           "             The directory of the jbf file by default.\n"
+           " -t <file>   lay out entries, or the whole page, after the\n"
+           "             template in <file>\n"
+           " -D <socket> run as a daemon, converting requests from -C on\n"
+           "             the Unix socket <socket> and keeping recently\n"
+           "             used jbf files open\n"
+           " -C <socket> have the daemon on <socket> run the rest of the\n"
+           "             command line. Without -o, the html is written to\n"
+           "             stdout. Must be the first option.\n"
            " -o <file>   direct output to <file>\n"
-           "             If not supplied, index.html is used.\n"
+           "             If not supplied, index.html is used, or standard\n"
+           "             output with -d.\n"
            " input       jbf file or directory where a jbf file is stored.\n"
            "             If none is given, current working directory is\n"
            "             searched for a file named pspbrwse.jbf\n");
@@ -57,160 +276,1234 @@ static void printhelp(void)
 
 int main(int argc, char *argv[])
 {
-    jbf_file *jbf;
-    int ret = !JBFSUCCESS;
-    int i;
-    char *infile = NULL;
-    char *outfile = NULL;
+    struct job job;
+    long workers;
+    int ret;
+
+    // client: pass the rest of the command line on to the daemon
+    if (argc > 2 && !strcmp(argv[1], "-C")) {
+        if (daemon_client(argv[2], argc - 3, &argv[3], &ret) != 0) {
+            fprintf(stderr, "error: no daemon listening on %s\n", argv[2]);
+            return -1;
+        }
+        return ret;
+    }
+
+    initjob(&job, NULL, stdout, stderr);
+    ret = parseargs(&job, argc, argv);
+    if (ret != 0) {
+        freejob(&job);
+        return ret > 0 ? 0 : -1;
+    }
+
+    // daemon: serve requests with one worker per cpu
+    if (job.socket != NULL) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        daemon_serve(job.socket, workers > 0 ? workers : 1, handlerequest);
+        fprintf(stderr, "error: can not listen on %s\n", job.socket);
+        freejob(&job);
+        return -1;
+    }
+
+    ret = runjob(&job);
+    freejob(&job);
+    return ret;
+}
+
+static void initjob(struct job *job, const char *cwd, FILE *out, FILE *err)
+{
+    memset(job, 0, sizeof(*job));
+    job->cwd  = cwd;
+    job->skip = SKIP_ZERO_THUMBS;
+    job->out  = out;
+    job->err  = err;
+}
+
+static void freejob(struct job *job)
+{
+    free(job->infile);
+    free(job->outfile);
+    free(job->oldfile);
+    free(job->imagedir);
+    free(job->socket);
+    template_free(job->tpl);
+}
+
+/* Copy of a path from the command line. Relative paths in daemon requests
+ * are made relative to the client's working directory.
+ */
+static char *jobpath(struct job *job, const char *path)
+{
+    char *copy;
+
+    if (job->cwd == NULL || path[0] == '/') {
+        return strdup(path);
+    }
+    copy = malloc(strlen(job->cwd) + strlen(path) + 2);
+    if (copy != NULL) {
+        sprintf(copy, "%s/%s", job->cwd, path);
+    }
+    return copy;
+}
+
+/* Parse the command line into job. Returns 0 if there is work to do, 1 if
+ * not (help was shown), and -1 on errors.
+ */
+static int parseargs(struct job *job, int argc, char *argv[])
+{
     int opt;
-    FILE *out;
-    uint32_t skip_zero_thumbs = 1;
 
-    /***********************************************************************
-     * parse command line
-     */
-    while ((opt = getopt(argc, argv, "hzo:")) != -1) {
+    while ((opt = getopt(argc, argv, "hzucpvsrj:w:m:d:f:t:x:b:D:o:")) != -1) {
         switch (opt) {
         case 'o':
-            outfile = optarg;
+            free(job->outfile);
+            job->outfile = jobpath(job, optarg);
             break;
 
         case 'h':
-            printhelp();
-            return 0;
+            printhelp(job->out);
+            return 1;
 
         case 'z':
-            skip_zero_thumbs = 0;
+            job->skip &= ~SKIP_ZERO_THUMBS;
+            break;
+
+        case 'u':
+            job->jbfopts.flags |= JBFOPT_URING;
+            break;
+
+        case 'c':
+            job->compact = 1;
+            break;
+
+        case 'p':
+            job->placeholders = 1;
+            break;
+
+        case 'v':
+            job->virtual = 1;
+            job->css |= CSS_VIRTUAL;
+            break;
+
+        case 's':
+            job->search = 1;
+            job->css |= CSS_SEARCH;
+            break;
+
+        case 'r':
+            job->jbfopts.flags |= JBFOPT_RECOVER;
+            break;
+
+        case 'j':
+            job->jbfopts.threads = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'w':
+            job->writers = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'm':
+            job->jbfopts.budget = strtoull(optarg, NULL, 0) * 1024 * 1024;
+            break;
+
+        case 'd':
+            free(job->oldfile);
+            job->oldfile = jobpath(job, optarg);
+            break;
+
+        case 'x':
+            if (!strcmp(optarg, "skip")) {
+                job->skip |= SKIP_MISSING;
+            }
+            else if (strcmp(optarg, "mark")) {
+                fprintf(job->err, "error: unknown check %s\n", optarg);
+                return -1;
+            }
+            job->css |= CSS_CHECK;
+            break;
+
+        case 'b':
+            free(job->imagedir);
+            job->imagedir = jobpath(job, optarg);
+            break;
+
+        case 't': {
+            char *path = jobpath(job, optarg);
+
+            template_free(job->tpl);
+            job->tpl = NULL;
+            if (path == NULL ||
+                template_load(path, templatefields, &job->tpl) != 0)
+            {
+                fprintf(job->err, "error: can not load template %s\n",
+                        optarg);
+                free(path);
+                return -1;
+            }
+            free(path);
+            break;
+        }
+
+        case 'f':
+            if (!strcmp(optarg, "json")) {
+                job->json = 1;
+            }
+            else if (strcmp(optarg, "text")) {
+                fprintf(job->err, "error: unknown format %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'D':
+            if (job->cwd != NULL) {
+                fprintf(job->err, "error: -D in a daemon request\n");
+                return -1;
+            }
+            free(job->socket);
+            job->socket = strdup(optarg);
             break;
         }
     }
 
     // input?
     if (optind < argc) {
-        infile = argv[optind];
+        job->infile = jobpath(job, argv[optind]);
+    }
+    else if (job->cwd != NULL) {
+        job->infile = strdup(job->cwd);
+    }
+
+    // open jbf files stay cached in the daemon, so there is no budget
+    if (job->cwd != NULL) {
+        job->jbfopts.budget = 0;
+        if (job->virtual && job->outfile == NULL) {
+            fprintf(job->err, "error: -v needs -o in a daemon request\n");
+            return -1;
+        }
     }
 
+    return 0;
+}
+
+/* Run one daemon request. getopt() keeps global state, so requests are
+ * parsed one at a time; setting optind to 0 makes glibc start over.
+ */
+static int handlerequest(const char *cwd, int argc, char **argv,
+                         FILE *out, FILE *err)
+{
+    static pthread_mutex_t getoptlock = PTHREAD_MUTEX_INITIALIZER;
+    struct job job;
+    int ret;
+
+    initjob(&job, cwd, out, err);
+
+    pthread_mutex_lock(&getoptlock);
+    optind = 0;
+    ret = parseargs(&job, argc, argv);
+    pthread_mutex_unlock(&getoptlock);
+
+    if (ret == 0) {
+        ret = runjob(&job);
+    }
+    else {
+        ret = ret > 0 ? 0 : -1;
+    }
+    freejob(&job);
+    return ret;
+}
+
+/* Whether job checks the image files, setting the status of entries. -x
+ * does nothing with -c or -d.
+ */
+static int jobchecks(struct job *job)
+{
+    return (job->css & CSS_CHECK) && !job->compact && job->oldfile == NULL;
+}
+
+/* Open a jbf file, through the cache in the daemon. Requests that change
+ * the entries get the file to themselves.
+ */
+static int jobopen(struct job *job, char *filename, jbf_file **jbf)
+{
+    if (job->cwd != NULL) {
+        return daemon_open(filename, &job->jbfopts,
+                           job->compact || jobchecks(job), jbf);
+    }
+    return jbf_open_opts(filename, &job->jbfopts, jbf);
+}
+
+static void jobclose(struct job *job, jbf_file *jbf)
+{
+    if (job->cwd != NULL) {
+        daemon_close(jbf, job->compact);
+    }
+    else {
+        jbf_close(jbf);
+    }
+}
+
+/* Run the conversion, compaction or diff described by job. */
+static int runjob(struct job *job)
+{
+    jbf_file *jbf;
+    jbf_file *oldjbf = NULL;
+    int ret = !JBFSUCCESS;
+    int rv = -1;
+    int i;
+    char *outfile = job->outfile;
+    char *jbfpath = NULL;
+    char *oldpath = NULL;
+    FILE *out = NULL;
+    FILE *msg = job->out;
+    uint32_t count;
+    search_index *index = NULL;
+    off_t outwindow = 0;
+    off_t outreleased = 0;
+    struct stat outstat;
+    struct markup markup = { NULL, 0, 0, 0 };
+    struct diffreport diff = { 0 };
+
     /***********************************************************************
      * open jbf file
      *
-     * if we get an argument, we assume it's
-     * 1. a complete file name or
-     * 2. a path
-     * otherwise, look for pspbrwse.jbf in cwd
+     * when entries are only printed one after another, they are parsed as
+     * they are printed, so that reading the file overlaps printing. Files
+     * cached by the daemon are parsed completely, for later requests.
      */
 
-    if (infile != NULL) {
-        // 1. a complete file name
-        ret = jbf_open(infile, &jbf);
+    if (job->cwd == NULL && !job->compact && job->oldfile == NULL &&
+        !(job->css & CSS_CHECK) && !job->virtual && job->writers == 0 &&
+        job->jbfopts.threads <= 1)
+    {
+        job->jbfopts.flags |= JBFOPT_STREAM;
+    }
 
-        // 2. a path
+    ret = openjbf(job, job->infile, job->cwd == NULL, &jbf, &jbfpath);
+    if (ret != JBFSUCCESS) {
+        fprintf(job->err, "error: jbf file not opened\n");
+        return -1;
+    }
+
+    if (jbf->skipcount != 0) {
+        fprintf(job->err,
+                "warning: %s is corrupt, skipped %u damaged regions "
+                "(%" PRIu64 " bytes)\n",
+                jbfpath, jbf->skipcount, jbf->skipbytes);
+    }
+
+    /***********************************************************************
+     * compact jbf file
+     *
+     * entries are checked against the directory the jbf file is in, or
+     * the one given with -b, and the result replaces the input unless -o
+     * is given
+     */
+
+    if (job->compact) {
+        uint32_t missing;
+        uint32_t duplicates;
+        char *jbfdir = strdup(jbfpath);
+
+        ret = jbf_compact(jbf,
+                          job->imagedir != NULL ?
+                          job->imagedir : dirname(jbfdir),
+                          &missing, &duplicates);
+        free(jbfdir);
+        if (ret == JBFEARGS) {
+            fprintf(job->err, "error: can not open image directory\n");
+            goto clean;
+        }
+        if (ret != JBFSUCCESS) {
+            fprintf(job->err, "error: out of memory\n");
+            goto clean;
+        }
+
+        ret = jbf_write(jbf, outfile != NULL ? outfile : jbfpath);
         if (ret != JBFSUCCESS) {
-            char *infile2 = calloc(1, strlen(infile) + 25);
-            strcat(infile2, infile);
-            strcat(infile2, "/pspbrwse.jbf");
-            ret = jbf_open(infile2, &jbf);
-            free(infile2);
+            fprintf(job->err, "error: can not write %s\n",
+                    outfile != NULL ? outfile : jbfpath);
+            goto clean;
         }
+
+        fprintf(msg, "%u entries kept, %u missing, %u duplicates removed\n",
+                jbf->entrycount, missing, duplicates);
+        rv = 0;
+        goto clean;
     }
 
-    // 3. look in cwd
-    if (ret != JBFSUCCESS) {
-        ret = jbf_open("pspbrwse.jbf", &jbf);
+    /***********************************************************************
+     * diff jbf files
+     *
+     * input is compared to the jbf file given with -d, and the changes are
+     * reported on stdout unless -o is given
+     */
+
+    if (job->oldfile != NULL) {
+        ret = openjbf(job, job->oldfile, 0, &oldjbf, &oldpath);
+        if (ret != JBFSUCCESS) {
+            fprintf(job->err, "error: jbf file %s not opened\n",
+                    job->oldfile);
+            oldjbf = NULL;
+            goto clean;
+        }
+
+        diff.out = msg;
+        diff.json = job->json;
+        if (outfile != NULL) {
+            diff.out = out = fopen(outfile, "w");
+            if (out == NULL) {
+                fprintf(job->err, "error: can not open %s\n", outfile);
+                goto clean;
+            }
+        }
+
+        if (diff.json) {
+            fprintf(diff.out, "[");
+        }
+        ret = jbf_diff(oldjbf, jbf, reportchange, &diff);
+        if (ret != JBFSUCCESS) {
+            fprintf(job->err, "error: out of memory\n");
+            goto clean;
+        }
+        if (diff.json) {
+            fprintf(diff.out, "\n]\n");
+        }
+        else {
+            fprintf(diff.out, "%u added, %u removed, %u changed\n",
+                    diff.added, diff.removed, diff.changed);
+        }
+        rv = 0;
+        goto clean;
     }
 
-    if (ret != JBFSUCCESS) {
-        fprintf(stderr, "error: jbf file not opened\n");
-        return -1;
+    // html goes back to the client if a daemon request has no -o, and
+    // messages then go to its stderr
+    if (job->cwd != NULL && outfile == NULL) {
+        msg = job->err;
+    }
+
+    /***********************************************************************
+     * check image files
+     *
+     * entries are looked up in the directory the jbf file is in, unless
+     * -b is given
+     */
+
+    if (jobchecks(job)) {
+        uint32_t missing = 0;
+        uint32_t stale = 0;
+        char *jbfdir = strdup(jbfpath);
+
+        ret = jbf_check(jbf, job->imagedir != NULL ?
+                        job->imagedir : dirname(jbfdir));
+        free(jbfdir);
+        if (ret != JBFSUCCESS) {
+            fprintf(job->err, "error: can not open image directory\n");
+            goto clean;
+        }
+
+        for (i = 0; i < jbf->entrycount; i++) {
+            if (jbf->entries[i].status & JBFSTAT_MISSING) {
+                missing++;
+            }
+            else if (jbf->entries[i].status != 0) {
+                stale++;
+            }
+        }
+        fprintf(msg, "%u images missing, %u changed since their thumbnail\n",
+                missing, stale);
     }
 
     /***********************************************************************
      * open output file
      */
 
-    if (outfile == NULL) {
-        outfile = "index.html";
-        out = fopen(outfile, "r");
-        if (out != NULL) {
-            fprintf(stderr, "error: index.html exists\n");
-            return -1;
+    if (job->cwd != NULL && outfile == NULL) {
+        out = job->out;
+    }
+    else {
+        if (outfile == NULL) {
+            outfile = "index.html";
+            out = fopen(outfile, "r");
+            if (out != NULL) {
+                fclose(out);
+                out = NULL;
+                fprintf(job->err, "error: index.html exists\n");
+                goto clean;
+            }
+        }
+        out = fopen(outfile, "w");
+        if (out == NULL) {
+            fprintf(job->err, "error: can not open %s\n", outfile);
+            goto clean;
         }
     }
-    out = fopen(outfile, "w");
-    if (out == NULL) {
-        fprintf(stderr, "error: can not open %s\n", outfile);
-        return -1;
+
+    // with a memory budget, written output is dropped from the page cache
+    // every quarter of the budget
+    if (job->jbfopts.budget != 0) {
+        setvbuf(out, NULL, _IOFBF, 64 * 1024);
+        outwindow = job->jbfopts.budget / 4;
     }
 
     /***********************************************************************
      * output html document
      */
 
-    fprintf(out,
-            "<!DOCTYPE html>\n"
-            "<!-- Created by jbf2html -->\n"
-            "<html>\n"
-            "<head>\n"
-            "<title>Browse</title>\n"
-            "<style>\n");
-    printcss(out);
-    fprintf(out,
-            "</style>\n"
-            "</head>\n"
-            "<body>\n"
-            "\n");
+    if (job->tpl != NULL && job->tpl->page) {
+        printtemplate(out, &job->tpl->parts[TEMPLATE_HEAD], NULL,
+                      job->placeholders, job->css);
+    }
+    else {
+        fprintf(out,
+                "<!DOCTYPE html>\n"
+                "<!-- Created by jbf2html -->\n"
+                "<html>\n"
+                "<head>\n"
+                "<title>Browse</title>\n"
+                "<style>\n");
+        printpagecss(out, job->css);
+        fprintf(out,
+                "</style>\n"
+                "</head>\n"
+                "<body>\n"
+                "\n");
+    }
 
-    // print entries
-    for (i = 0; i < jbf->entrycount; i++) {
-        if (jbf->entries[i].thumbnail.size == 0 && skip_zero_thumbs) {
-            continue;
+    if (job->search) {
+        index = search_new();
+        if (index == NULL) {
+            fprintf(job->err, "error: out of memory\n");
+            goto clean;
+        }
+        fprintf(out,
+                "<div id=\"search\">"
+                "<input type=\"search\" placeholder=\"Search\" />"
+                "</div>\n"
+                "\n");
+    }
+
+    // print entries; threads writing at planned offsets need the output
+    // to be a file, and the layout to be the built-in one
+    if (job->virtual) {
+        ret = printvirtual(out, job->err, outfile, jbf, job->skip, index);
+        if (ret != 0) {
+            goto clean;
+        }
+    }
+    else if (job->writers != 0 && job->tpl == NULL &&
+             job->jbfopts.budget == 0 &&
+             fstat(fileno(out), &outstat) == 0 && S_ISREG(outstat.st_mode))
+    {
+        ret = printparallel(out, job->err, jbf, job->skip,
+                            job->placeholders, job->writers, index);
+        if (ret != 0) {
+            goto clean;
+        }
+    }
+    else {
+        for (i = 0, count = 0; i < jbf->entrycount; i++) {
+            ret = jbf_fetch(jbf, i);
+            if (ret != JBFSUCCESS) {
+                fprintf(job->err, ret == JBFEIO ?
+                        "error: can not read %s\n" : "error: %s is corrupt\n",
+                        jbfpath);
+                goto clean;
+            }
+            if (skipentry(&jbf->entries[i], job->skip)) {
+                continue;
+            }
+            if (job->tpl != NULL) {
+                // the search script finds template entries by the wrapper
+                if (index != NULL) {
+                    fputs("<div data-entry style=\"display: contents\">\n",
+                          out);
+                }
+                ret = printtemplate(out, &job->tpl->parts[TEMPLATE_ENTRY],
+                                    &jbf->entries[i], job->placeholders,
+                                    job->css);
+                if (index != NULL) {
+                    fputs("</div>\n", out);
+                }
+            }
+            else {
+                ret = printentry(out, &jbf->entries[i], job->placeholders,
+                                 &markup);
+            }
+            if (ret != 0) {
+                fprintf(job->err, "error: out of memory\n");
+                goto clean;
+            }
+            jbf_release(jbf, &jbf->entries[i]);
+            releaseoutput(out, &outreleased, outwindow);
+            if (index != NULL &&
+                search_add(index, count, jbf->entries[i].filename,
+                           jbf->entries[i].filenamelength) != 0)
+            {
+                fprintf(job->err, "error: out of memory\n");
+                goto clean;
+            }
+            count++;
         }
-        printentry(out, &jbf->entries[i]);
+    }
+
+    if (index != NULL) {
+        printsearch(out, msg, index, jbf, job->skip, job->virtual);
     }
 
     // close html
-    fprintf(out,
-            "</body>\n"
-            "</html>\n");
+    if (job->tpl != NULL && job->tpl->page) {
+        printtemplate(out, &job->tpl->parts[TEMPLATE_TAIL], NULL,
+                      job->placeholders, job->css);
+    }
+    else {
+        fprintf(out,
+                "</body>\n"
+                "</html>\n");
+    }
+    rv = 0;
 
-    jbf_close(jbf);
+ clean:
+    // check results are per request, and the jbf file may be cached;
+    // others may be reading it unless it was opened for the check
+    if (jobchecks(job)) {
+        for (i = 0; i < jbf->entrycount; i++) {
+            jbf->entries[i].status = 0;
+        }
+    }
 
-    return 0;
+    if (out != NULL && out != job->out) {
+        fclose(out);
+    }
+    search_free(index);
+    free(markup.buf);
+    if (oldjbf != NULL) {
+        jobclose(job, oldjbf);
+    }
+    jobclose(job, jbf);
+    free(oldpath);
+    free(jbfpath);
+    return rv;
 }
 
-static void printentry(FILE *out, jbf_entry *entry)
+/* Open a jbf file given on the command line. If we get an argument, we
+ * assume it's
+ * 1. a complete file name or
+ * 2. a path
+ * otherwise, or if cwd is set and neither works, look for pspbrwse.jbf in
+ * cwd.
+ *
+ * The name of the file that was opened is returned in *path, which must be
+ * freed by caller.
+ */
+static int openjbf(struct job *job, char *infile, int cwd, jbf_file **jbf,
+                   char **path)
+{
+    int ret = !JBFSUCCESS;
+    char *name = NULL;
+
+    if (infile != NULL) {
+        // 1. a complete file name
+        name = strdup(infile);
+        ret = jobopen(job, name, jbf);
+
+        // 2. a path
+        if (ret != JBFSUCCESS) {
+            free(name);
+            name = calloc(1, strlen(infile) + 25);
+            strcat(name, infile);
+            strcat(name, "/pspbrwse.jbf");
+            ret = jobopen(job, name, jbf);
+        }
+    }
+
+    // 3. look in cwd
+    if (ret != JBFSUCCESS && (infile == NULL || cwd)) {
+        free(name);
+        name = strdup("pspbrwse.jbf");
+        ret = jobopen(job, name, jbf);
+    }
+
+    if (ret != JBFSUCCESS) {
+        free(name);
+        name = NULL;
+    }
+    *path = name;
+    return ret;
+}
+
+/* jbf_diff report callback, printing each change as a line of text or an
+ * element of a JSON array.
+ */
+static void reportchange(void *arg, uint32_t changes, jbf_entry *old,
+                         jbf_entry *new)
+{
+    struct diffreport *diff = (struct diffreport *) arg;
+    const char *change;
+    const char *sep;
+    int i;
+
+    if (changes & JBFDIFF_ADDED) {
+        change = "added";
+        diff->added++;
+    }
+    else if (changes & JBFDIFF_REMOVED) {
+        change = "removed";
+        new = old;
+        diff->removed++;
+    }
+    else {
+        change = "changed";
+        diff->changed++;
+    }
+
+    if (diff->json) {
+        fprintf(diff->out, "%s\n{\"change\":\"%s\",\"filename\":",
+                diff->added + diff->removed + diff->changed > 1 ? "," : "",
+                change);
+        printjson(diff->out, new->filename);
+    }
+    else {
+        fprintf(diff->out, "%-8s %s", change, new->filename);
+    }
+
+    // fields that differ for changed entries
+    sep = diff->json ? ",\"fields\":[" : " (";
+    for (i = 0; i < (int) (sizeof(diffields) / sizeof(diffields[0])); i++) {
+        if (changes & diffields[i].change) {
+            fprintf(diff->out, diff->json ? "%s\"%s\"" : "%s%s", sep,
+                    diffields[i].name);
+            sep = diff->json ? "," : ", ";
+        }
+    }
+    if (changes & (JBFDIFF_FILETIME | JBFDIFF_FILESIZE | JBFDIFF_THUMBNAIL)) {
+        fputc(diff->json ? ']' : ')', diff->out);
+    }
+
+    fputs(diff->json ? "}" : "\n", diff->out);
+}
+
+/* Write out output data and drop it from the page cache once more than
+ * window bytes have been written since last time, so that a large output
+ * file does not fill memory with dirty pages.
+ */
+static void releaseoutput(FILE *out, off_t *released, off_t window)
+{
+    off_t pos;
+
+    if (window == 0) {
+        return;
+    }
+    pos = ftello(out);
+    if (pos - *released < window) {
+        return;
+    }
+
+    fflush(out);
+    fdatasync(fileno(out));
+    posix_fadvise(fileno(out), *released, pos - *released,
+                  POSIX_FADV_DONTNEED);
+    *released = pos;
+}
+
+/* Format the markup of entry in the built-in layout into m: everything
+ * before the thumbnail data, then everything after it. info is what
+ * thumbinfo() found. Returns 0 on success, or -1 if m->buf could not be
+ * grown.
+ */
+static int formatentry(struct markup *m, jbf_entry *entry,
+                       const jpeg_info *info)
 {
-    unsigned char *imgdata;
     char *filetime;
     char *filesize;
+    char imgattr[80];
+    escaped_name name;
+    char *buf;
+    int head;
+    int tail;
+    int rv = 0;
 
-    imgdata  = base64_encode(entry->thumbnail.data, entry->thumbnail.size, NULL);
+    if (escape_name(entry->filename, entry->filenamelength, &name) != 0) {
+        return -1;
+    }
     filetime = filetimeS(entry);
     filesize = filesizeS(entry);
+    imgattrS(info, imgattr, sizeof(imgattr));
 
-    fprintf(out,
-            "<div class=\"object\">\n"
-            "<a href=\"%s\"\n"
-            "title=\"%s\n"
-            "%u x %u x %s, %s\n"
-            "%s\n"
-            "%s\">\n"
-            "<span class=\"container\">\n"
-            "<img class=\"thumbnail\" src=\"data:image/jpeg;charset=utf-8;base64,\n%s\" />\n"
-            "</span>\n"
-            "<span class=\"filename\">%s</span>\n"
-            "</a>\n"
-            "</div>\n"
-            "\n",
-            entry->filename,
-            entry->filename, entry->width, entry->height, BppS(entry), filesize,
-            JbfFiletypeES(entry),
-            filetime,
-            imgdata,
-            entry->filename);
+    for (;;) {
+        head = snprintf(m->buf, m->size,
+                        "<div class=\"object%s%s\" data-entry>\n"
+                        "<a href=\"%s\"\n"
+                        "title=\"%s\n"
+                        "%u x %u x %s, %s\n"
+                        "%s\n"
+                        "%s\">\n"
+                        "<span class=\"container\">\n"
+                        "<img class=\"thumbnail\"%s src=\"data:image/jpeg;charset=utf-8;base64,\n",
+                        *statusS(entry) ? " " : "", statusS(entry),
+                        name.url,
+                        name.html, entry->width, entry->height, BppS(entry),
+                        filesize,
+                        JbfFiletypeES(entry),
+                        filetime,
+                        imgattr);
+        tail = snprintf(m->buf + ((size_t) head < m->size ? head : 0),
+                        (size_t) head < m->size ? m->size - head : 0,
+                        "\" />\n"
+                        "</span>\n"
+                        "<span class=\"filename\">%s</span>\n"
+                        "</a>\n"
+                        "</div>\n"
+                        "\n",
+                        name.html);
+        if (head < 0 || tail < 0) {
+            rv = -1;
+            break;
+        }
+        if ((size_t) head + tail < m->size) {
+            m->headlen = head;
+            m->length  = head + tail;
+            break;
+        }
+
+        // grow and format again
+        buf = (char *) realloc(m->buf, head + tail + 1024);
+        if (buf == NULL) {
+            rv = -1;
+            break;
+        }
+        m->buf  = buf;
+        m->size = head + tail + 1024;
+    }
+
+    escape_free(&name);
+    free(filetime);
+    free(filesize);
+    return rv;
+}
+
+/* Print entry in the built-in layout. Returns -1, having printed nothing,
+ * if there was no memory to format it.
+ */
+static int printentry(FILE *out, jbf_entry *entry, uint32_t placeholders,
+                      struct markup *m)
+{
+    unsigned char *imgdata;
+    size_t imglen;
+    jpeg_info info;
 
+    if (formatentry(m, entry, thumbinfo(entry, placeholders, &info)) != 0) {
+        return -1;
+    }
+    imgdata = base64_encode(entry->thumbnail.data, entry->thumbnail.size,
+                            &imglen);
+    if (imgdata == NULL) {
+        return -1;
+    }
+
+    fwrite(m->buf, 1, m->headlen, out);
+    fwrite(imgdata, 1, imglen, out);
+    fwrite(m->buf + m->headlen, 1, m->length - m->headlen, out);
+    free(imgdata);
+    return 0;
+}
+
+/* Write all of data at pos, however many pwrite calls it takes. */
+static int pwriteall(int fd, const void *data, size_t len, uint64_t pos)
+{
+    const char *p = (const char *) data;
+    ssize_t written;
+
+    while (len > 0) {
+        written = pwrite(fd, p, len, pos);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        p   += written;
+        len -= written;
+        pos += written;
+    }
+    return 0;
+}
+
+static int writebuf_flush(struct writebuf *wb)
+{
+    if (pwriteall(wb->fd, wb->data, wb->used, wb->pos) != 0) {
+        return -1;
+    }
+    wb->pos += wb->used;
+    wb->used = 0;
+    return 0;
+}
+
+static int writebuf_put(struct writebuf *wb, const void *data, size_t len)
+{
+    if (wb->used + len > WRITE_BUFFER && writebuf_flush(wb) != 0) {
+        return -1;
+    }
+    if (len >= WRITE_BUFFER) {
+        if (pwriteall(wb->fd, data, len, wb->pos) != 0) {
+            return -1;
+        }
+        wb->pos += len;
+        return 0;
+    }
+    memcpy(wb->data + wb->used, data, len);
+    wb->used += len;
+    return 0;
+}
+
+static void *write_thread(void *arg)
+{
+    struct writepool *pool = (struct writepool *) arg;
+    struct markup markup = { NULL, 0, 0, 0 };
+    struct writebuf wb = { pool->fd, NULL, 0, 0 };
+    jbf_entry *entry;
+    unsigned char *imgdata;
+    size_t imglen;
+    uint32_t first;
+    uint32_t last;
+    uint32_t i;
+
+    if (!pool->plan) {
+        wb.data = (char *) malloc(WRITE_BUFFER);
+        if (wb.data == NULL) {
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    while (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED) &&
+           (first = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) *
+            WRITE_CHUNK) < pool->count)
+    {
+        last = pool->count - first < WRITE_CHUNK ?
+            pool->count : first + WRITE_CHUNK;
+        if (!pool->plan) {
+            wb.pos = pool->offsets[first];
+        }
+
+        for (i = first; i < last; i++) {
+            // the thumbnail is parsed once, in the first pass
+            entry = &pool->jbf->entries[pool->order[i]];
+            if (pool->plan) {
+                pool->hasinfo[i] = thumbinfo(entry, pool->placeholders,
+                                             &pool->infos[i]) != NULL;
+            }
+            if (formatentry(&markup, entry,
+                            pool->hasinfo[i] ? &pool->infos[i] : NULL) != 0)
+            {
+                __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (pool->plan) {
+                pool->offsets[i + 1] = markup.length +
+                    base64_encoded_len(entry->thumbnail.size);
+                continue;
+            }
+
+            imgdata = base64_encode(entry->thumbnail.data,
+                                    entry->thumbnail.size, &imglen);
+            if (imgdata == NULL ||
+                writebuf_put(&wb, markup.buf, markup.headlen) != 0 ||
+                writebuf_put(&wb, imgdata, imglen) != 0 ||
+                writebuf_put(&wb, markup.buf + markup.headlen,
+                             markup.length - markup.headlen) != 0)
+            {
+                free(imgdata);
+                __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            free(imgdata);
+        }
+
+        // the chunk must end where the next one was planned to start
+        if (!pool->plan &&
+            !__atomic_load_n(&pool->failed, __ATOMIC_RELAXED) &&
+            (writebuf_flush(&wb) != 0 || wb.pos != pool->offsets[last]))
+        {
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(markup.buf);
+    free(wb.data);
+    return NULL;
+}
+
+/* Run a pass of pool with threads threads, this one included. */
+static int write_pass(struct writepool *pool, uint32_t threads)
+{
+    pthread_t *tids;
+    uint32_t started = 0;
+
+    tids = (pthread_t *) calloc(threads, sizeof(*tids));
+    if (tids == NULL) {
+        return -1;
+    }
+    pool->next = 0;
+    for (started = 0; started + 1 < threads; started++) {
+        if (pthread_create(&tids[started], NULL, write_thread, pool) != 0) {
+            break;
+        }
+    }
+
+    // whatever is left if no thread could be started
+    write_thread(pool);
+
+    while (started > 0) {
+        pthread_join(tids[--started], NULL);
+    }
+    free(tids);
+    return pool->failed ? -1 : 0;
+}
+
+/* Print entries with a pool of threads. The size of every entry in the
+ * output is worked out first, so that the file can be allocated in one go
+ * and each thread write its entries with pwrite where they belong, rather
+ * than all of them queuing up on out. Leaves out positioned after the
+ * entries. Returns 0 on success.
+ */
+static int printparallel(FILE *out, FILE *err, jbf_file *jbf, uint32_t skip,
+                         uint32_t placeholders, uint32_t threads,
+                         search_index *index)
+{
+    struct writepool pool = { 0 };
+    uint64_t start;
+    uint32_t i;
+    int rv = -1;
+
+    pool.jbf          = jbf;
+    pool.placeholders = placeholders;
+    pool.fd           = fileno(out);
+    pool.order   = (uint32_t *) malloc((jbf->entrycount + 1) *
+                                       sizeof(*pool.order));
+    pool.offsets = (uint64_t *) malloc((jbf->entrycount + 1) *
+                                       sizeof(*pool.offsets));
+    pool.infos   = (jpeg_info *) malloc((jbf->entrycount + 1) *
+                                        sizeof(*pool.infos));
+    pool.hasinfo = (uint8_t *) malloc(jbf->entrycount + 1);
+    if (pool.order == NULL || pool.offsets == NULL ||
+        pool.infos == NULL || pool.hasinfo == NULL)
+    {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+
+    for (i = 0; i < jbf->entrycount; i++) {
+        if (skipentry(&jbf->entries[i], skip)) {
+            continue;
+        }
+        if (index != NULL &&
+            search_add(index, pool.count, jbf->entries[i].filename,
+                       jbf->entries[i].filenamelength) != 0)
+        {
+            fprintf(err, "error: out of memory\n");
+            goto clean;
+        }
+        pool.order[pool.count++] = i;
+    }
+
+    // entries start after what has been printed so far
+    fflush(out);
+    start = ftello(out);
+    pool.offsets[0] = start;
+
+    // plan
+    pool.plan = 1;
+    if (write_pass(&pool, threads) != 0) {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+    for (i = 0; i < pool.count; i++) {
+        pool.offsets[i + 1] += pool.offsets[i];
+    }
+
+    // posix_fallocate() would write every block where the file system
+    // can not allocate them, so that is left to the writes
+    if (pool.offsets[pool.count] > start &&
+        fallocate(pool.fd, 0, start, pool.offsets[pool.count] - start) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        fprintf(err, "error: can not allocate %" PRIu64 " bytes: %s\n",
+                pool.offsets[pool.count] - start, strerror(errno));
+        goto clean;
+    }
+
+    // write
+    pool.plan = 0;
+    if (write_pass(&pool, threads) != 0) {
+        fprintf(err, "error: can not write output\n");
+        goto clean;
+    }
+    if (fseeko(out, pool.offsets[pool.count], SEEK_SET) != 0) {
+        fprintf(err, "error: can not write output\n");
+        goto clean;
+    }
+    rv = 0;
+
+ clean:
+    free(pool.order);
+    free(pool.offsets);
+    free(pool.infos);
+    free(pool.hasinfo);
+    return rv;
+}
+
+/* Print an entry, or the head or tail of the page when entry is NULL,
+ * from a compiled template part. Only the fields the part uses are
+ * formatted. Returns -1, having printed nothing, if they could not be.
+ */
+static int printtemplate(FILE *out, template_part *part, jbf_entry *entry,
+                         uint32_t placeholders, uint32_t css)
+{
+    unsigned char *imgdata = NULL;
+    size_t imglen = 0;
+    char *filetime = NULL;
+    char *filesize = NULL;
+    char imgattr[80] = "";
+    jpeg_info info;
+    escaped_name name = { NULL, NULL, NULL };
+    uint32_t i;
+    int rv = -1;
+
+    if (entry != NULL) {
+        if ((part->fields & ((1ULL << TemplateFieldE_filename) |
+                             (1ULL << TemplateFieldE_url))) &&
+            escape_name(entry->filename, entry->filenamelength, &name) != 0)
+        {
+            goto clean;
+        }
+        if (part->fields & (1ULL << TemplateFieldE_thumb)) {
+            imgdata = base64_encode(entry->thumbnail.data,
+                                    entry->thumbnail.size, &imglen);
+            if (imgdata == NULL) {
+                goto clean;
+            }
+        }
+        if (part->fields & (1ULL << TemplateFieldE_filetime)) {
+            filetime = filetimeS(entry);
+        }
+        if (part->fields & (1ULL << TemplateFieldE_filesize)) {
+            filesize = filesizeS(entry);
+        }
+        if (part->fields & (1ULL << TemplateFieldE_imgattr)) {
+            imgattrS(thumbinfo(entry, placeholders, &info), imgattr,
+                     sizeof(imgattr));
+        }
+    }
+
+    for (i = 0; i < part->count; i++) {
+        template_op *op = &part->ops[i];
+
+        if (op->field == TEMPLATE_LITERAL) {
+            fwrite(op->text, 1, op->length, out);
+            continue;
+        }
+        if (op->field == TemplateFieldE_css) {
+            printpagecss(out, css);
+            continue;
+        }
+        if (entry == NULL) {
+            continue;
+        }
+
+        switch (op->field) {
+        case TemplateFieldE_filename:
+            fputs(name.html, out);
+            break;
+        case TemplateFieldE_url:
+            fputs(name.url, out);
+            break;
+        case TemplateFieldE_width:
+            fprintf(out, "%u", entry->width);
+            break;
+        case TemplateFieldE_height:
+            fprintf(out, "%u", entry->height);
+            break;
+        case TemplateFieldE_bpp:
+            fputs(BppS(entry), out);
+            break;
+        case TemplateFieldE_filesize:
+            fputs(filesize, out);
+            break;
+        case TemplateFieldE_filetype:
+            fputs(JbfFiletypeES(entry), out);
+            break;
+        case TemplateFieldE_filetime:
+            fputs(filetime, out);
+            break;
+        case TemplateFieldE_thumb:
+            fwrite(imgdata, 1, imglen, out);
+            break;
+        case TemplateFieldE_imgattr:
+            fputs(imgattr, out);
+            break;
+        case TemplateFieldE_status:
+            fputs(statusS(entry), out);
+            break;
+        }
+    }
+    rv = 0;
+
+ clean:
+    escape_free(&name);
     free(imgdata);
     free(filetime);
     free(filesize);
+    return rv;
+}
+
+static void printpagecss(FILE *out, uint32_t css)
+{
+    printcss(out);
+    if (css & CSS_VIRTUAL) {
+        printvirtualcss(out);
+    }
+    if (css & CSS_SEARCH) {
+        printsearchcss(out);
+    }
+    if (css & CSS_CHECK) {
+        printcheckcss(out);
+    }
+}
+
+static void printcheckcss(FILE *out)
+{
+    fprintf(out,
+            ".missing {\n"
+            "  opacity: 0.4;\n"
+            "}\n"
+            ".stale .filename {\n"
+            "  font-style: italic;\n"
+            "}\n");
+}
+
+static void printsearchcss(FILE *out)
+{
+    fprintf(out,
+            "#search {\n"
+            "  position: sticky;\n"
+            "  top: 0;\n"
+            "  z-index: 1;\n"
+            "  padding: 5px;\n"
+            "  background: white;\n"
+            "}\n");
+}
+
+static void printvirtualcss(FILE *out)
+{
+    fprintf(out,
+            "#grid {\n"
+            "  position: relative;\n"
+            "}\n"
+            "#grid .object {\n"
+            "  position: absolute;\n"
+            "  float: none;\n"
+            "}\n");
 }
 
 static void printcss(FILE *out)
@@ -264,6 +1557,493 @@ static void printcss(FILE *out)
             "}\n");
 }
 
+/* Print the entries of jbf for virtual scrolling. Entry metadata is
+ * written as a JSON array, and thumbnails to files in a directory named
+ * after outfile. A small script keeps tiles in the page only for the
+ * entries in view, reusing the tile elements as the page is scrolled, so
+ * that the browser's memory use does not depend on the number of entries.
+ *
+ * Returns 0 on success.
+ */
+static int printvirtual(FILE *out, FILE *err, char *outfile, jbf_file *jbf,
+                        uint32_t skip, search_index *index)
+{
+    char *thumbdir = NULL;
+    char *thumbpath = NULL;
+    char *path;
+    char *base = NULL;
+    char *ext;
+    FILE *thumb;
+    jbf_entry *entry;
+    jpeg_info info;
+    char *filetime;
+    char *filesize;
+    char buf[512];
+    escaped_name name;
+    uint32_t count = 0;
+    int rv = -1;
+    int i;
+
+    // thumbnails go in <outfile without extension>_thumbs/
+    path = strdup(outfile);
+    if (path == NULL ||
+        (base = strdup(basename(path))) == NULL)
+    {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+    ext = strrchr(base, '.');
+    if (ext != NULL && ext != base) {
+        *ext = '\0';
+    }
+    thumbdir = malloc(strlen(base) + 8);
+    thumbpath = malloc(strlen(outfile) + strlen(base) + 28);
+    if (thumbdir == NULL || thumbpath == NULL) {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+    sprintf(thumbdir, "%s_thumbs", base);
+    strcpy(path, outfile);
+    sprintf(thumbpath, "%s/%s", dirname(path), thumbdir);
+    free(base);
+    base = NULL;
+    free(path);
+
+    path = malloc(strlen(thumbpath) + 16);
+    if (path == NULL) {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+    if (mkdir(thumbpath, 0777) != 0 && errno != EEXIST) {
+        fprintf(err, "error: can not create %s\n", thumbpath);
+        goto clean;
+    }
+
+    // the directory name is part of every thumbnail url
+    if (escape_name(thumbdir, strlen(thumbdir), &name) != 0) {
+        fprintf(err, "error: out of memory\n");
+        goto clean;
+    }
+    fprintf(out, "<div id=\"grid\"></div>\n<script>\nvar thumbdir = ");
+    printjson(out, name.url);
+    fprintf(out, " + \"/\";\nvar entries = [\n");
+    escape_free(&name);
+
+    for (i = 0; i < jbf->entrycount; i++) {
+        entry = &jbf->entries[i];
+        if (skipentry(entry, skip)) {
+            continue;
+        }
+
+        if (entry->thumbnail.size == 0 ||
+            jpeg_getinfo(entry->thumbnail.data, entry->thumbnail.size,
+                         0, &info) != 0)
+        {
+            info.width = 0;
+            info.height = 0;
+        }
+
+        sprintf(path, "%s/%u.jpg", thumbpath, count);
+        if (entry->thumbnail.size != 0) {
+            thumb = fopen(path, "w");
+            if (thumb == NULL ||
+                fwrite(entry->thumbnail.data, 1, entry->thumbnail.size,
+                       thumb) != entry->thumbnail.size ||
+                fclose(thumb) != 0)
+            {
+                fprintf(err, "error: can not write %s\n", path);
+                goto clean;
+            }
+        }
+        else {
+            // one from an earlier run would be stale
+            unlink(path);
+        }
+
+        filetime = filetimeS(entry);
+        filesize = filesizeS(entry);
+        snprintf(buf, sizeof(buf),
+                 "%u x %u x %s, %s\n"
+                 "%s\n"
+                 "%s",
+                 entry->width, entry->height, BppS(entry), filesize,
+                 JbfFiletypeES(entry),
+                 filetime);
+        free(filetime);
+        free(filesize);
+
+        fprintf(out, "%s[", count ? ",\n" : "");
+        printjson(out, entry->filename);
+        fprintf(out, ",");
+        printjson(out, buf);
+        fprintf(out, ",%u,%u,%d",
+                info.width, info.height, entry->thumbnail.size != 0);
+
+        // the link, if the name needs escaping in it
+        if (escape_name(entry->filename, entry->filenamelength,
+                        &name) != 0)
+        {
+            fprintf(err, "error: out of memory\n");
+            goto clean;
+        }
+        if (*statusS(entry) || name.url != entry->filename) {
+            fprintf(out, ",\"%s\"", statusS(entry));
+        }
+        if (name.url != entry->filename) {
+            fprintf(out, ",");
+            printjson(out, name.url);
+        }
+        escape_free(&name);
+        fprintf(out, "]");
+        if (index != NULL &&
+            search_add(index, count, entry->filename,
+                       entry->filenamelength) != 0)
+        {
+            fprintf(err, "error: out of memory\n");
+            goto clean;
+        }
+        jbf_release(jbf, entry);
+        count++;
+    }
+    removestale(thumbpath, count);
+
+    fprintf(out, "\n];\n");
+    fputs("(function () {\n"
+          "  var grid = document.getElementById(\"grid\");\n"
+          "  var shown = [];\n"
+          "  var pool = [];\n"
+          "  var pending = false;\n"
+          "  var tw, th, cols, i;\n"
+          "\n"
+          "  function tile() {\n"
+          "    var div = document.createElement(\"div\");\n"
+          "    div.className = \"object\";\n"
+          "    div.innerHTML = '<a><span class=\"container\">' +\n"
+          "      '<img class=\"thumbnail\"></span>' +\n"
+          "      '<span class=\"filename\"></span></a>';\n"
+          "    div.pos = -1;\n"
+          "    grid.appendChild(div);\n"
+          "    pool.push(div);\n"
+          "    return div;\n"
+          "  }\n"
+          "\n"
+          "  function fill(div, n) {\n"
+          "    var e = entries[n];\n"
+          "    var a = div.firstChild;\n"
+          "    var img = a.firstChild.firstChild;\n"
+          "    div.className = e[5] ? \"object \" + e[5] : \"object\";\n"
+          "    a.setAttribute(\"href\", e[6] || e[0]);\n"
+          "    a.title = e[0] + \"\\n\" + e[1];\n"
+          "    if (e[2]) {\n"
+          "      img.width = e[2];\n"
+          "      img.height = e[3];\n"
+          "    } else {\n"
+          "      img.removeAttribute(\"width\");\n"
+          "      img.removeAttribute(\"height\");\n"
+          "    }\n"
+          "    img.src = e[4] ? thumbdir + n + \".jpg\" : \"\";\n"
+          "    a.lastChild.textContent = e[0];\n"
+          "  }\n"
+          "\n"
+          "  function render() {\n"
+          "    var top = grid.getBoundingClientRect().top;\n"
+          "    var first = Math.max(0, Math.floor(-top / th) - 1);\n"
+          "    var last = Math.ceil((window.innerHeight - top) / th) + 1;\n"
+          "    var start = first * cols;\n"
+          "    var end = Math.min(shown.length, last * cols);\n"
+          "    var used = {}, free = [], div, j;\n"
+          "\n"
+          "    // keep tiles that are still in view, recycle the rest\n"
+          "    for (j = 0; j < pool.length; j++) {\n"
+          "      div = pool[j];\n"
+          "      if (div.pos >= start && div.pos < end &&\n"
+          "          shown[div.pos] === div.index) {\n"
+          "        used[div.pos] = div;\n"
+          "      } else {\n"
+          "        free.push(div);\n"
+          "      }\n"
+          "    }\n"
+          "    for (j = start; j < end; j++) {\n"
+          "      if (used[j]) {\n"
+          "        continue;\n"
+          "      }\n"
+          "      div = free.length ? free.pop() : tile();\n"
+          "      div.pos = j;\n"
+          "      div.index = shown[j];\n"
+          "      fill(div, shown[j]);\n"
+          "      div.style.left = (j % cols) * tw + \"px\";\n"
+          "      div.style.top = Math.floor(j / cols) * th + \"px\";\n"
+          "      div.style.display = \"\";\n"
+          "    }\n"
+          "    for (j = 0; j < free.length; j++) {\n"
+          "      free[j].pos = -1;\n"
+          "      free[j].style.display = \"none\";\n"
+          "    }\n"
+          "  }\n"
+          "\n"
+          "  function layout() {\n"
+          "    cols = Math.max(1, Math.floor(grid.clientWidth / tw));\n"
+          "    grid.style.height = Math.ceil(shown.length / cols) * th + \"px\";\n"
+          "    render();\n"
+          "  }\n"
+          "\n"
+          "  function schedule() {\n"
+          "    if (!pending) {\n"
+          "      pending = true;\n"
+          "      window.requestAnimationFrame(function () {\n"
+          "        pending = false;\n"
+          "        render();\n"
+          "      });\n"
+          "    }\n"
+          "  }\n"
+          "\n"
+          "  // show the entries with the given indices\n"
+          "  window.showEntries = function (list) {\n"
+          "    shown = list;\n"
+          "    for (var j = 0; j < pool.length; j++) {\n"
+          "      pool[j].pos = -1;\n"
+          "    }\n"
+          "    layout();\n"
+          "  };\n"
+          "\n"
+          "  if (entries.length == 0) {\n"
+          "    return;\n"
+          "  }\n"
+          "\n"
+          "  // tile size, from a tile with the style sheet applied\n"
+          "  fill(tile(), 0);\n"
+          "  var cs = window.getComputedStyle(pool[0]);\n"
+          "  tw = pool[0].offsetWidth + parseFloat(cs.marginLeft) +\n"
+          "    parseFloat(cs.marginRight);\n"
+          "  th = pool[0].offsetHeight + parseFloat(cs.marginTop) +\n"
+          "    parseFloat(cs.marginBottom);\n"
+          "\n"
+          "  for (i = 0; i < entries.length; i++) {\n"
+          "    shown.push(i);\n"
+          "  }\n"
+          "  window.addEventListener(\"scroll\", schedule);\n"
+          "  window.addEventListener(\"resize\", layout);\n"
+          "  layout();\n"
+          "})();\n"
+          "</script>\n",
+          out);
+    rv = 0;
+
+ clean:
+    free(path);
+    free(base);
+    free(thumbdir);
+    free(thumbpath);
+    return rv;
+}
+
+/* Remove the thumbnails numbered count and up from thumbpath, left there
+ * by an earlier run with more entries.
+ */
+static void removestale(const char *thumbpath, uint32_t count)
+{
+    DIR *dir;
+    struct dirent *d;
+    unsigned long n;
+    char name[32];
+
+    dir = opendir(thumbpath);
+    if (dir == NULL) {
+        return;
+    }
+    while ((d = readdir(dir)) != NULL) {
+        // only names printvirtual() writes
+        n = strtoul(d->d_name, NULL, 10);
+        snprintf(name, sizeof(name), "%lu.jpg", n);
+        if (n >= count && !strcmp(name, d->d_name)) {
+            unlinkat(dirfd(dir), d->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+/* Print the search index, and the script running the search box. With
+ * virtual scrolling the file names are already in the page; otherwise
+ * they are printed too. Index statistics are reported on stdout.
+ */
+static void printsearch(FILE *out, FILE *msg, search_index *index,
+                        jbf_file *jbf, uint32_t skip, uint32_t virtual)
+{
+    uint32_t trigrams;
+    uint64_t nsec;
+    long bytes;
+    int i;
+    int first = 1;
+
+    fprintf(out, "<script>\n");
+
+    if (!virtual) {
+        fprintf(out, "var searchnames = [");
+        for (i = 0; i < jbf->entrycount; i++) {
+            if (skipentry(&jbf->entries[i], skip)) {
+                continue;
+            }
+            fprintf(out, first ? "\n" : ",\n");
+            printjson(out, jbf->entries[i].filename);
+            first = 0;
+        }
+        fprintf(out, "\n];\n");
+    }
+
+    fprintf(out, "var searchindex = ");
+    bytes = search_print(index, out);
+    fprintf(out, ";\n");
+
+    search_stats(index, &trigrams, &nsec);
+    fprintf(msg, "search index: %u trigrams, %ld bytes, built in %.1f ms\n",
+           trigrams, bytes, nsec / 1e6);
+
+    fputs("(function () {\n"
+          "  var input = document.querySelector(\"#search input\");\n"
+          "  var names = typeof entries != \"undefined\" ?\n"
+          "    entries.map(function (e) { return e[0]; }) : searchnames;\n"
+          "  var lower = null;\n"
+          "  var tiles = null;\n"
+          "  var shown = [];\n"
+          "  var timer = null;\n"
+          "\n"
+          "  function ids(key) {\n"
+          "    var d = searchindex[key] || [];\n"
+          "    var list = [], id = 0, i;\n"
+          "    for (i = 0; i < d.length; i++) {\n"
+          "      id += d[i];\n"
+          "      list.push(id);\n"
+          "    }\n"
+          "    return list;\n"
+          "  }\n"
+          "\n"
+          "  function intersect(a, b) {\n"
+          "    var list = [], i = 0, j = 0;\n"
+          "    while (i < a.length && j < b.length) {\n"
+          "      if (a[i] < b[j]) {\n"
+          "        i++;\n"
+          "      } else if (a[i] > b[j]) {\n"
+          "        j++;\n"
+          "      } else {\n"
+          "        list.push(a[i]);\n"
+          "        i++;\n"
+          "        j++;\n"
+          "      }\n"
+          "    }\n"
+          "    return list;\n"
+          "  }\n"
+          "\n"
+          "  // candidates from the index, then checked against the query\n"
+          "  function search(q) {\n"
+          "    var cand = null, list = [], i, c0, c1, c2;\n"
+          "    q = q.toLowerCase();\n"
+          "    if (lower === null) {\n"
+          "      lower = names.map(function (n) { return n.toLowerCase(); });\n"
+          "    }\n"
+          "    for (i = 0; i + 3 <= q.length && (cand === null || cand.length); i++) {\n"
+          "      c0 = q.charCodeAt(i);\n"
+          "      c1 = q.charCodeAt(i + 1);\n"
+          "      c2 = q.charCodeAt(i + 2);\n"
+          "      if (c0 < 128 && c1 < 128 && c2 < 128) {\n"
+          "        var l = ids((c0 << 16) | (c1 << 8) | c2);\n"
+          "        cand = cand === null ? l : intersect(cand, l);\n"
+          "      }\n"
+          "    }\n"
+          "    if (cand === null) {\n"
+          "      cand = [];\n"
+          "      for (i = 0; i < names.length; i++) {\n"
+          "        cand.push(i);\n"
+          "      }\n"
+          "    }\n"
+          "    for (i = 0; i < cand.length; i++) {\n"
+          "      if (lower[cand[i]].indexOf(q) >= 0) {\n"
+          "        list.push(cand[i]);\n"
+          "      }\n"
+          "    }\n"
+          "    return list;\n"
+          "  }\n"
+          "\n"
+          "  function show(list) {\n"
+          "    var on, d, i;\n"
+          "    if (window.showEntries) {\n"
+          "      window.showEntries(list);\n"
+          "      return;\n"
+          "    }\n"
+          "    if (tiles === null) {\n"
+          "      tiles = document.querySelectorAll(\"[data-entry]\");\n"
+          "      for (i = 0; i < tiles.length; i++) {\n"
+          "        shown.push(tiles[i].style.display);\n"
+          "      }\n"
+          "    }\n"
+          "    on = new Uint8Array(tiles.length);\n"
+          "    for (i = 0; i < list.length; i++) {\n"
+          "      on[list[i]] = 1;\n"
+          "    }\n"
+          "    for (i = 0; i < tiles.length; i++) {\n"
+          "      d = on[i] ? shown[i] : \"none\";\n"
+          "      if (tiles[i].style.display != d) {\n"
+          "        tiles[i].style.display = d;\n"
+          "      }\n"
+          "    }\n"
+          "  }\n"
+          "\n"
+          "  input.addEventListener(\"input\", function () {\n"
+          "    clearTimeout(timer);\n"
+          "    timer = setTimeout(function () {\n"
+          "      show(search(input.value));\n"
+          "    }, 100);\n"
+          "  });\n"
+          "})();\n"
+          "</script>\n",
+          out);
+}
+
+/* Print str as a JSON string. '<' is escaped too, so that the string can
+ * not end the script element it is in.
+ */
+static void printjson(FILE *out, const char *str)
+{
+    const unsigned char *p;
+
+    fputc('"', out);
+    for (p = (const unsigned char *) str; *p; p++) {
+        switch (*p) {
+        case '"':  fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '<':  fputs("\\u003c", out); break;
+        default:
+            if (*p < 0x20) {
+                fprintf(out, "\\u%04x", *p);
+            }
+            else {
+                fputc(*p, out);
+            }
+            break;
+        }
+    }
+    fputc('"', out);
+}
+
+/* Whether entry is left out of the page, for the SKIP_* flags in skip. */
+static int skipentry(jbf_entry *entry, uint32_t skip)
+{
+    return ((skip & SKIP_ZERO_THUMBS) && entry->thumbnail.size == 0) ||
+           ((skip & SKIP_MISSING) && (entry->status & JBFSTAT_MISSING));
+}
+
+/* Class for the result of the image file check, if any. */
+static const char *statusS(jbf_entry *entry)
+{
+    if (entry->status & JBFSTAT_MISSING) {
+        return "missing";
+    }
+    if (entry->status & (JBFSTAT_FILESIZE | JBFSTAT_FILETIME)) {
+        return "stale";
+    }
+    return "";
+}
+
 /* Convert bpp to string as displayed in PSP7.
  *
  * Returned pointer must not be freed.
@@ -333,9 +2113,6 @@ static char *filetimeS(jbf_entry *entry)
     struct tm tf_tm;
     char buf[256];
 
-#define TICKS_PER_SECOND 10000000
-#define EPOCH_DIFFERENCE 11644473600LL
-
     filetime  = entry->filetime;
     filetime /= TICKS_PER_SECOND;
     filetime -= EPOCH_DIFFERENCE;
@@ -381,3 +2158,42 @@ static char *filesizeS(jbf_entry *entry)
     }
     return strdup(buf);
 }
+
+/* Find the dimensions and, if color is set, the placeholder color of the
+ * thumbnail of entry. Returns info, or NULL if the thumbnail can not be
+ * parsed.
+ */
+static const jpeg_info *thumbinfo(jbf_entry *entry, uint32_t color,
+                                  jpeg_info *info)
+{
+    if (jpeg_getinfo(entry->thumbnail.data, entry->thumbnail.size,
+                     color, info) != 0)
+    {
+        return NULL;
+    }
+    return info;
+}
+
+/* Write size and placeholder color attributes, from info, for the
+ * thumbnail img tag to buf, so that browsers can lay out the page before
+ * the thumbnails are decoded. buf is set to an empty string if info is
+ * NULL.
+ */
+static void imgattrS(const jpeg_info *info, char *buf, size_t size)
+{
+    int len;
+
+    buf[0] = '\0';
+    if (info == NULL) {
+        return;
+    }
+
+    len = snprintf(buf, size,
+                   " width=\"%u\" height=\"%u\"",
+                   info->width, info->height);
+    if (info->hascolor) {
+        snprintf(buf + len, size - len,
+                 " style=\"background-color: #%02x%02x%02x\"",
+                 info->color[0], info->color[1], info->color[2]);
+    }
+}
@@ -0,0 +1,606 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include "jpeg.h"
+
+/* Minimal baseline JPEG decoder. Only what is needed to find the image
+ * dimensions and the average color of a thumbnail is implemented: markers
+ * are parsed, and the entropy coded data is Huffman decoded, but only the
+ * DC coefficients are kept. The average of the DC coefficients of a
+ * component is the average value of that component, so no IDCT is needed.
+ */
+
+#define LUT_BITS 9
+
+struct huff {
+    int           valid;
+    uint8_t       lut_len[1 << LUT_BITS];  // 0: code longer than LUT_BITS
+    uint8_t       lut_val[1 << LUT_BITS];
+    int32_t       maxcode[18];
+    int32_t       valptr[17];
+    int32_t       mincode[17];
+    uint8_t       huffval[256];
+};
+
+struct component {
+    uint8_t       id;
+    uint8_t       h;
+    uint8_t       v;
+    uint8_t       tq;
+    uint8_t       td;
+    uint8_t       ta;
+    int32_t       pred;
+    uint32_t      width;     // size in component samples
+    uint32_t      height;
+    int64_t       dcsum;     // DC sum, weighted by block coverage
+    uint64_t      pixels;
+};
+
+struct bitreader {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t      buf;
+    int           bits;
+    int           marker;    // hit a marker, feeding zeros
+    int           zeros;     // zero bits fed past the data
+};
+
+struct decoder {
+    struct huff   dc[4];
+    struct huff   ac[4];
+    uint16_t      q0[4];     // DC quantizer of each table
+    struct component comp[3];
+    int           ncomp;
+    int           hmax;
+    int           vmax;
+    int           baseline;
+    uint32_t      restart;
+};
+
+static int build_huff(struct huff *h, const uint8_t *counts,
+                      const uint8_t *vals, int nvals)
+{
+    int code = 0;
+    int k = 0;
+    int l;
+    int i;
+
+    if (nvals > 256) {
+        return -1;
+    }
+    memset(h, 0, sizeof(*h));
+    memcpy(h->huffval, vals, nvals);
+
+    for (l = 1; l <= 16; l++) {
+        h->valptr[l]  = k;
+        h->mincode[l] = code;
+        for (i = 0; i < counts[l - 1]; i++, k++, code++) {
+            // more codes than fit in l bits
+            if (code >= (1 << l)) {
+                return -1;
+            }
+            if (l <= LUT_BITS) {
+                int shift = LUT_BITS - l;
+                int j;
+                for (j = 0; j < (1 << shift); j++) {
+                    h->lut_len[(code << shift) | j] = l;
+                    h->lut_val[(code << shift) | j] = vals[k];
+                }
+            }
+        }
+        h->maxcode[l] = counts[l - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    h->maxcode[17] = 0x7fffffff;
+    h->valid = 1;
+    return 0;
+}
+
+static void br_fill(struct bitreader *br)
+{
+    uint32_t c;
+
+    while (br->bits <= 24) {
+        c = 0;
+        if (br->marker || br->p >= br->end) {
+            br->zeros += 8;
+        }
+        else {
+            c = *br->p;
+            if (c != 0xff) {
+                br->p++;
+            }
+            else if (br->p + 1 < br->end && br->p[1] == 0x00) {
+                // stuffed zero byte
+                br->p += 2;
+            }
+            else {
+                br->marker = 1;
+                br->zeros += 8;
+                c = 0;
+            }
+        }
+        br->buf |= c << (24 - br->bits);
+        br->bits += 8;
+    }
+}
+
+static uint32_t br_get(struct bitreader *br, int n)
+{
+    uint32_t v;
+
+    br_fill(br);
+    v = br->buf >> (32 - n);
+    br->buf <<= n;
+    br->bits -= n;
+    return v;
+}
+
+static int br_decode(struct bitreader *br, struct huff *h)
+{
+    uint32_t code;
+    int len;
+
+    br_fill(br);
+    code = br->buf >> (32 - LUT_BITS);
+    len = h->lut_len[code];
+    if (len) {
+        br->buf <<= len;
+        br->bits -= len;
+        return h->lut_val[code];
+    }
+
+    for (len = LUT_BITS + 1; len <= 16; len++) {
+        code = br->buf >> (32 - len);
+        if ((int32_t) code <= h->maxcode[len]) {
+            br->buf <<= len;
+            br->bits -= len;
+            return h->huffval[h->valptr[len] + code - h->mincode[len]];
+        }
+    }
+    return -1;
+}
+
+static int32_t br_receive(struct bitreader *br, int s)
+{
+    int32_t v;
+
+    if (s == 0) {
+        return 0;
+    }
+    v = br_get(br, s);
+    if (v < (1 << (s - 1))) {
+        v -= (1 << s) - 1;
+    }
+    return v;
+}
+
+/* Skip to the data following the next RSTn marker.
+ */
+static void br_restart(struct bitreader *br)
+{
+    while (br->p + 1 < br->end &&
+           !(br->p[0] == 0xff && br->p[1] >= 0xd0 && br->p[1] <= 0xd7))
+    {
+        br->p++;
+    }
+    if (br->p + 1 < br->end) {
+        br->p += 2;
+    }
+    br->buf = 0;
+    br->bits = 0;
+    br->marker = 0;
+    br->zeros = 0;
+}
+
+/* Whether all bits of the data have been read, and only zeros are left. */
+static int br_done(struct bitreader *br)
+{
+    return (br->marker || br->p >= br->end) && br->bits <= br->zeros;
+}
+
+static uint32_t coverage(uint32_t size, uint32_t block)
+{
+    if (block * 8 >= size) {
+        return 0;
+    }
+    return size - block * 8 < 8 ? size - block * 8 : 8;
+}
+
+/* Decode a block at block position bx, by within the component. Blocks
+ * are weighted by the number of image pixels they cover, so that padding
+ * at the right and bottom edges does not skew the average.
+ */
+static int decode_block(struct decoder *dec, struct bitreader *br,
+                        struct component *c, uint32_t bx, uint32_t by)
+{
+    struct huff *ac = &dec->ac[c->ta];
+    uint32_t pixels;
+    uint32_t code;
+    uint32_t buf;
+    int len;
+    int s;
+    int k;
+
+    s = br_decode(br, &dec->dc[c->td]);
+    if (s < 0 || s > 11) {
+        return -1;
+    }
+    c->pred += br_receive(br, s);
+    pixels = coverage(c->width, bx) * coverage(c->height, by);
+    c->dcsum += (int64_t) c->pred * pixels;
+    c->pixels += pixels;
+
+    // AC coefficients still need decoding to find the next block, but
+    // their values are not needed: a short code and its value bits are
+    // skipped in one go
+    for (k = 1; k < 64; k++) {
+        br_fill(br);
+
+        // local copies; the compiler can not keep br in registers as
+        // the byte loads in br_fill() may alias it
+        buf  = br->buf;
+        code = buf >> (32 - LUT_BITS);
+        len  = ac->lut_len[code];
+        if (len) {
+            s = ac->lut_val[code];
+            len += s & 0x0f;
+            br->buf  = buf << len;
+            br->bits -= len;
+        }
+        else {
+            s = br_decode(br, ac);
+            if (s < 0) {
+                return -1;
+            }
+            if (s & 0x0f) {
+                br_get(br, s & 0x0f);
+            }
+        }
+
+        if ((s & 0x0f) == 0) {
+            if (s != 0xf0) {
+                break;     // EOB
+            }
+            k += 15;       // ZRL
+        }
+        else {
+            k += s >> 4;
+        }
+    }
+    return 0;
+}
+
+static const uint8_t *decode_scan(struct decoder *dec, const uint8_t *seg,
+                                  size_t seglen, const uint8_t *end,
+                                  uint32_t width, uint32_t height)
+{
+    struct component *scomp[3];
+    struct bitreader br;
+    uint32_t mcux;
+    uint32_t mcuy;
+    uint32_t mcus;
+    uint32_t mcu;
+    uint32_t mx;
+    uint32_t my;
+    uint32_t bx;
+    uint32_t by;
+    int ns;
+    int i;
+    int j;
+
+    ns = seg[0];
+    if (ns < 1 || ns > dec->ncomp || seglen < 1 + 2 * ns) {
+        return NULL;
+    }
+    for (i = 0; i < ns; i++) {
+        scomp[i] = NULL;
+        for (j = 0; j < dec->ncomp; j++) {
+            if (dec->comp[j].id == seg[1 + 2 * i]) {
+                scomp[i] = &dec->comp[j];
+            }
+        }
+        if (scomp[i] == NULL) {
+            return NULL;
+        }
+        scomp[i]->td = seg[2 + 2 * i] >> 4;
+        scomp[i]->ta = seg[2 + 2 * i] & 0x0f;
+        scomp[i]->pred = 0;
+        if (scomp[i]->td > 3 || scomp[i]->ta > 3 ||
+            !dec->dc[scomp[i]->td].valid ||
+            !dec->ac[scomp[i]->ta].valid)
+        {
+            return NULL;
+        }
+    }
+
+    if (ns == 1) {
+        // non-interleaved, one block per MCU
+        mcux = (scomp[0]->width + 7) / 8;
+        mcuy = (scomp[0]->height + 7) / 8;
+    }
+    else {
+        mcux = (width + 8 * dec->hmax - 1) / (8 * dec->hmax);
+        mcuy = (height + 8 * dec->vmax - 1) / (8 * dec->vmax);
+    }
+    mcus = mcux * mcuy;
+
+    // a block takes two bits at least, for its DC and an EOB, so a
+    // header claiming more blocks than the data can hold is bogus
+    for (i = 0, j = 0; i < ns; i++) {
+        j += ns == 1 ? 1 : scomp[i]->h * scomp[i]->v;
+    }
+    if ((uint64_t) mcus * j * 2 > (uint64_t) (end - (seg + seglen)) * 8) {
+        return NULL;
+    }
+
+    memset(&br, 0, sizeof(br));
+    br.p = seg + seglen;
+    br.end = end;
+
+    for (mcu = 0; mcu < mcus; mcu++) {
+        if (dec->restart && mcu && mcu % dec->restart == 0) {
+            br_restart(&br);
+            for (i = 0; i < ns; i++) {
+                scomp[i]->pred = 0;
+            }
+        }
+        // truncated data; what has been decoded is all there is
+        if (br_done(&br)) {
+            break;
+        }
+        mx = mcu % mcux;
+        my = mcu / mcux;
+        for (i = 0; i < ns; i++) {
+            struct component *c = scomp[i];
+            if (ns == 1) {
+                if (decode_block(dec, &br, c, mx, my) != 0) {
+                    return NULL;
+                }
+                continue;
+            }
+            for (by = 0; by < c->v; by++) {
+                for (bx = 0; bx < c->h; bx++) {
+                    if (decode_block(dec, &br, c, mx * c->h + bx,
+                                     my * c->v + by) != 0)
+                    {
+                        return NULL;
+                    }
+                }
+            }
+        }
+    }
+
+    // continue at the marker ending the scan
+    while (br.p + 1 < end &&
+           !(br.p[0] == 0xff && br.p[1] != 0x00 &&
+             (br.p[1] < 0xd0 || br.p[1] > 0xd7)))
+    {
+        br.p++;
+    }
+    return br.p;
+}
+
+static uint8_t clamp(double v)
+{
+    if (v < 0) {
+        return 0;
+    }
+    if (v > 255) {
+        return 255;
+    }
+    return (uint8_t) (v + 0.5);
+}
+
+/* Find dimensions and, if color is set, the average color of a JPEG image.
+ * The dimensions are known if 0 is returned; info->hascolor tells whether
+ * the average color could be computed as well, which requires a baseline
+ * image. Finding the dimensions is cheap, but the average color requires
+ * Huffman decoding the whole image.
+ */
+int jpeg_getinfo(const uint8_t *data, size_t size, int color, jpeg_info *info)
+{
+    struct decoder dec;
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    const uint8_t *seg;
+    size_t seglen;
+    double mean[3];
+    int havesize = 0;
+    uint8_t m;
+    int i;
+
+    memset(info, 0, sizeof(*info));
+    memset(&dec, 0, sizeof(dec));
+
+    if (size < 4 || p[0] != 0xff || p[1] != 0xd8) {
+        return -1;
+    }
+    p += 2;
+
+    while (p + 4 <= end) {
+        if (p[0] != 0xff) {
+            break;
+        }
+        m = p[1];
+        if (m == 0xff) {
+            p++;
+            continue;
+        }
+        if (m == 0xd9) {
+            break;
+        }
+        seglen = ((p[2] << 8) | p[3]) - 2;
+        seg = p + 4;
+        if (seglen > (size_t) (end - seg)) {
+            break;
+        }
+        p = seg + seglen;
+
+        switch (m) {
+        case 0xc0:  // baseline
+        case 0xc1:  // extended sequential, Huffman
+        case 0xc2:  // progressive, dimensions only
+        case 0xc3:
+        case 0xc5: case 0xc6: case 0xc7:
+        case 0xc9: case 0xca: case 0xcb:
+        case 0xcd: case 0xce: case 0xcf:
+            if (seglen < 6) {
+                return -1;
+            }
+            info->height = (seg[1] << 8) | seg[2];
+            info->width  = (seg[3] << 8) | seg[4];
+            havesize = 1;
+
+            if (!color) {
+                return 0;
+            }
+
+            dec.ncomp = seg[5];
+            dec.baseline = (m == 0xc0 || m == 0xc1) && seg[0] == 8;
+            if (dec.ncomp != 1 && dec.ncomp != 3) {
+                dec.baseline = 0;
+            }
+            if (!dec.baseline || seglen < 6 + 3 * dec.ncomp) {
+                return 0;
+            }
+            for (i = 0; i < dec.ncomp; i++) {
+                dec.comp[i].id = seg[6 + 3 * i];
+                dec.comp[i].h  = seg[7 + 3 * i] >> 4;
+                dec.comp[i].v  = seg[7 + 3 * i] & 0x0f;
+                dec.comp[i].tq = seg[8 + 3 * i] & 0x03;
+                if (dec.comp[i].h < 1 || dec.comp[i].h > 4 ||
+                    dec.comp[i].v < 1 || dec.comp[i].v > 4)
+                {
+                    return 0;
+                }
+                if (dec.comp[i].h > dec.hmax) {
+                    dec.hmax = dec.comp[i].h;
+                }
+                if (dec.comp[i].v > dec.vmax) {
+                    dec.vmax = dec.comp[i].v;
+                }
+            }
+            break;
+
+        case 0xc4:  // DHT
+            while (seglen >= 17) {
+                int n = 0;
+                int tc = seg[0] >> 4;
+                int th = seg[0] & 0x0f;
+                for (i = 0; i < 16; i++) {
+                    n += seg[1 + i];
+                }
+                if (tc > 1 || th > 3 || n > 256 || seglen < 17 + n ||
+                    build_huff(tc ? &dec.ac[th] : &dec.dc[th],
+                               &seg[1], &seg[17], n) != 0)
+                {
+                    return havesize ? 0 : -1;
+                }
+                seg += 17 + n;
+                seglen -= 17 + n;
+            }
+            break;
+
+        case 0xdb:  // DQT
+            while (seglen >= 65) {
+                int pq = seg[0] >> 4;
+                int tq = seg[0] & 0x03;
+                if (pq) {
+                    if (seglen < 129) {
+                        break;
+                    }
+                    dec.q0[tq] = (seg[1] << 8) | seg[2];
+                    seg += 129;
+                    seglen -= 129;
+                }
+                else {
+                    dec.q0[tq] = seg[1];
+                    seg += 65;
+                    seglen -= 65;
+                }
+            }
+            break;
+
+        case 0xdd:  // DRI
+            if (seglen >= 2) {
+                dec.restart = (seg[0] << 8) | seg[1];
+            }
+            break;
+
+        case 0xda:  // SOS
+            if (!havesize) {
+                return -1;
+            }
+            if (!dec.baseline || info->width == 0 || info->height == 0) {
+                return 0;
+            }
+            for (i = 0; i < dec.ncomp; i++) {
+                struct component *c = &dec.comp[i];
+                c->width  = (info->width * c->h + dec.hmax - 1) / dec.hmax;
+                c->height = (info->height * c->v + dec.vmax - 1) / dec.vmax;
+            }
+            p = decode_scan(&dec, seg, seglen, end,
+                            info->width, info->height);
+            if (p == NULL) {
+                return 0;
+            }
+            break;
+
+        default:
+            // APPn, COM and others
+            break;
+        }
+    }
+
+    if (!havesize) {
+        return -1;
+    }
+
+    // the DC coefficient is eight times the average level-shifted value
+    for (i = 0; i < dec.ncomp; i++) {
+        if (dec.comp[i].pixels == 0) {
+            return 0;
+        }
+        mean[i] = (double) dec.comp[i].dcsum * dec.q0[dec.comp[i].tq] /
+            (8.0 * dec.comp[i].pixels) + 128.0;
+    }
+
+    if (dec.ncomp == 1) {
+        info->color[0] = info->color[1] = info->color[2] = clamp(mean[0]);
+    }
+    else {
+        // YCbCr to RGB, JFIF
+        info->color[0] = clamp(mean[0] + 1.402 * (mean[2] - 128.0));
+        info->color[1] = clamp(mean[0] - 0.344136 * (mean[1] - 128.0) -
+                               0.714136 * (mean[2] - 128.0));
+        info->color[2] = clamp(mean[0] + 1.772 * (mean[1] - 128.0));
+    }
+    info->hascolor = 1;
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "search.h"
+
+/* Trigram index over file names, for filtering a gallery in the browser
+ * without scanning the page. Names are lowercased, and each trigram of
+ * ASCII characters maps to the ids of the names containing it. Trigrams
+ * with other characters are left out; the browser checks each candidate
+ * against the full query anyway, so the index only has to never miss a
+ * match.
+ *
+ * Ids are added in increasing order, so posting lists are built sorted by
+ * appending, and the whole index is built in time linear in the total
+ * length of the names.
+ */
+
+struct posting {
+    uint32_t      key;       // three characters, first in the high byte
+    uint32_t      count;
+    uint32_t      allocated;
+    uint32_t     *ids;
+};
+
+struct search_index {
+    struct posting *table;   // open addressing, key 0 marks a free slot
+    uint32_t      size;
+    uint32_t      used;
+    uint64_t      nsec;      // time spent building and printing
+};
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+search_index *search_new(void)
+{
+    search_index *idx;
+
+    idx = (search_index *) calloc(1, sizeof(*idx));
+    if (idx == NULL) {
+        return NULL;
+    }
+    idx->size = 1024;
+    idx->table = (struct posting *) calloc(idx->size, sizeof(struct posting));
+    if (idx->table == NULL) {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static struct posting *lookup(search_index *idx, uint32_t key)
+{
+    uint32_t slot = (key * 2654435761u) & (idx->size - 1);
+
+    while (idx->table[slot].key != 0 &&
+           idx->table[slot].key != key)
+    {
+        slot = (slot + 1) & (idx->size - 1);
+    }
+    return &idx->table[slot];
+}
+
+static int grow(search_index *idx)
+{
+    struct posting *old = idx->table;
+    uint32_t oldsize = idx->size;
+    uint32_t i;
+
+    idx->size *= 2;
+    idx->table = (struct posting *) calloc(idx->size, sizeof(struct posting));
+    if (idx->table == NULL) {
+        idx->table = old;
+        idx->size = oldsize;
+        return -1;
+    }
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].key != 0) {
+            *lookup(idx, old[i].key) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+int search_add(search_index *idx, uint32_t id, const char *name,
+               uint32_t length)
+{
+    struct posting *p;
+    uint32_t key = 0;
+    uint32_t ascii = 0;   // number of trailing ASCII characters in key
+    uint32_t *ids;
+    uint32_t i;
+    uint8_t c;
+    uint64_t start = now();
+    int rv = 0;
+
+    for (i = 0; i < length; i++) {
+        c = (uint8_t) name[i];
+        if (c >= 0x80 || c == 0) {
+            ascii = 0;
+            continue;
+        }
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        key = ((key << 8) | c) & 0xffffff;
+        if (++ascii < 3) {
+            continue;
+        }
+
+        if (2 * (idx->used + 1) > idx->size && grow(idx) != 0) {
+            rv = -1;
+            break;
+        }
+        p = lookup(idx, key);
+        if (p->key == 0) {
+            p->key = key;
+            idx->used++;
+        }
+
+        // a name may contain the same trigram more than once
+        if (p->count != 0 && p->ids[p->count - 1] == id) {
+            continue;
+        }
+        if (p->count == p->allocated) {
+            ids = (uint32_t *) realloc(p->ids, (p->allocated ?
+                                                p->allocated * 2 : 4) *
+                                       sizeof(uint32_t));
+            if (ids == NULL) {
+                rv = -1;
+                break;
+            }
+            p->allocated = p->allocated ? p->allocated * 2 : 4;
+            p->ids = ids;
+        }
+        p->ids[p->count++] = id;
+    }
+
+    idx->nsec += now() - start;
+    return rv;
+}
+
+/* Print the index as a JSON object mapping each trigram, as a number, to
+ * its delta encoded list of ids.
+ *
+ * Returns the number of bytes written.
+ */
+long search_print(search_index *idx, FILE *out)
+{
+    struct posting *p;
+    long bytes = 0;
+    uint32_t prev;
+    uint32_t i;
+    uint32_t j;
+    int first = 1;
+    uint64_t start = now();
+
+    bytes += fprintf(out, "{");
+    for (i = 0; i < idx->size; i++) {
+        p = &idx->table[i];
+        if (p->key == 0) {
+            continue;
+        }
+        bytes += fprintf(out, "%s\n\"%u\":[", first ? "" : ",", p->key);
+        first = 0;
+        for (j = 0, prev = 0; j < p->count; j++) {
+            bytes += fprintf(out, j ? ",%u" : "%u", p->ids[j] - prev);
+            prev = p->ids[j];
+        }
+        bytes += fprintf(out, "]");
+    }
+    bytes += fprintf(out, "\n}");
+
+    idx->nsec += now() - start;
+    return bytes;
+}
+
+/* Number of distinct trigrams, and the time spent building and printing
+ * the index so far.
+ */
+void search_stats(search_index *idx, uint32_t *trigrams, uint64_t *nsec)
+{
+    *trigrams = idx->used;
+    *nsec = idx->nsec;
+}
+
+void search_free(search_index *idx)
+{
+    uint32_t i;
+
+    if (idx != NULL) {
+        for (i = 0; i < idx->size; i++) {
+            free(idx->table[i].ids);
+        }
+        free(idx->table);
+        free(idx);
+    }
+}
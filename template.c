@@ -0,0 +1,215 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "template.h"
+
+/* User templates for the html output. A template is plain text with
+ * {name} placeholders, where name is one of the fields given by the
+ * caller; braces around anything else are kept as they are, so CSS and
+ * scripts can be written without escaping. An {entries} ... {/entries}
+ * block marks the part printed for each entry.
+ *
+ * The template is compiled once into a flat list of ops per part,
+ * literal spans pointing into the template text and field references, so
+ * printing an entry is a walk over the list.
+ */
+
+#define NAME_MAX_LENGTH 32
+
+static int push_op(template_part *part, uint32_t *allocated, int32_t field,
+                   const char *text, uint32_t length)
+{
+    template_op *ops;
+
+    if (field == TEMPLATE_LITERAL && length == 0) {
+        return 0;
+    }
+
+    if (part->count == *allocated) {
+        *allocated = *allocated ? 2 * *allocated : 16;
+        ops = (template_op *) realloc(part->ops,
+                                      *allocated * sizeof(template_op));
+        if (ops == NULL) {
+            return -1;
+        }
+        part->ops = ops;
+    }
+
+    part->ops[part->count].field  = field;
+    part->ops[part->count].text   = text;
+    part->ops[part->count].length = length;
+    part->count++;
+    if (field != TEMPLATE_LITERAL) {
+        part->fields |= 1ULL << field;
+    }
+    return 0;
+}
+
+/* Look up the placeholder starting at p, returning its field index, or
+ * TEMPLATE_LITERAL if p does not start a known placeholder. The length of
+ * the placeholder, braces included, is returned in *length.
+ */
+static int32_t lookup(const char *p, const char *end,
+                      const char *const *fields, uint32_t *length)
+{
+    const char *close;
+    int32_t i;
+
+    *length = 0;
+    close = memchr(p + 1, '}', end - p - 1 < NAME_MAX_LENGTH ?
+                               end - p - 1 : NAME_MAX_LENGTH);
+    if (close == NULL) {
+        return TEMPLATE_LITERAL;
+    }
+
+    *length = close - p + 1;
+    for (i = 0; fields[i] != NULL && i < 64; i++) {
+        if (strlen(fields[i]) == *length - 2 &&
+            !memcmp(fields[i], p + 1, *length - 2))
+        {
+            return i;
+        }
+    }
+    return TEMPLATE_LITERAL;
+}
+
+/* Load and compile the template in filename. fields is a NULL terminated
+ * list of at most 64 placeholder names; ops refer to them by index.
+ */
+int template_load(const char *filename, const char *const *fields,
+                  template **tpl)
+{
+    template *t;
+    FILE *in;
+    long size;
+    const char *p;
+    const char *end;
+    const char *span;
+    uint32_t allocated[TEMPLATE_PARTS] = { 0 };
+    uint32_t length;
+    int32_t field;
+    int part;
+
+    t = (template *) calloc(1, sizeof(template));
+    if (t == NULL) {
+        return -1;
+    }
+
+    in = fopen(filename, "rb");
+    if (in == NULL) {
+        free(t);
+        return -1;
+    }
+    if (fseek(in, 0, SEEK_END) != 0 ||
+        (size = ftell(in)) < 0 ||
+        fseek(in, 0, SEEK_SET) != 0 ||
+        (t->text = (char *) malloc(size + 1)) == NULL ||
+        fread(t->text, 1, size, in) != (size_t) size)
+    {
+        fclose(in);
+        template_free(t);
+        return -1;
+    }
+    fclose(in);
+    t->text[size] = '\0';
+
+    // a template without an {entries} block is all entry part
+    t->page = strstr(t->text, "{entries}") != NULL;
+    part = t->page ? TEMPLATE_HEAD : TEMPLATE_ENTRY;
+
+    end = t->text + size;
+    for (p = span = t->text; p < end; p++) {
+        if (*p != '{') {
+            continue;
+        }
+
+        field = lookup(p, end, fields, &length);
+        if (field == TEMPLATE_LITERAL) {
+            if (part == TEMPLATE_HEAD && length == 9 &&
+                !memcmp(p, "{entries}", 9))
+            {
+                if (push_op(&t->parts[part], &allocated[part],
+                            TEMPLATE_LITERAL, span, p - span) != 0)
+                {
+                    goto fail;
+                }
+                part = TEMPLATE_ENTRY;
+            }
+            else if (part == TEMPLATE_ENTRY && t->page && length == 10 &&
+                     !memcmp(p, "{/entries}", 10))
+            {
+                if (push_op(&t->parts[part], &allocated[part],
+                            TEMPLATE_LITERAL, span, p - span) != 0)
+                {
+                    goto fail;
+                }
+                part = TEMPLATE_TAIL;
+            }
+            else {
+                continue;
+            }
+        }
+        else if (push_op(&t->parts[part], &allocated[part],
+                         TEMPLATE_LITERAL, span, p - span) != 0 ||
+                 push_op(&t->parts[part], &allocated[part],
+                         field, p, length) != 0)
+        {
+            goto fail;
+        }
+
+        p += length - 1;
+        span = p + 1;
+    }
+    if (push_op(&t->parts[part], &allocated[part],
+                TEMPLATE_LITERAL, span, end - span) != 0)
+    {
+        goto fail;
+    }
+
+    *tpl = t;
+    return 0;
+
+ fail:
+    template_free(t);
+    return -1;
+}
+
+void template_free(template *tpl)
+{
+    int i;
+
+    if (tpl == NULL) {
+        return;
+    }
+    for (i = 0; i < TEMPLATE_PARTS; i++) {
+        free(tpl->parts[i].ops);
+    }
+    free(tpl->text);
+    free(tpl);
+}
@@ -0,0 +1,63 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+
+#ifndef _TEMPLATE_H
+#define _TEMPLATE_H
+
+// template parts
+#define TEMPLATE_HEAD     0   // before {entries}, printed once
+#define TEMPLATE_ENTRY    1   // between {entries} and {/entries}, per entry
+#define TEMPLATE_TAIL     2   // after {/entries}, printed once
+#define TEMPLATE_PARTS    3
+
+#define TEMPLATE_LITERAL  -1
+
+typedef struct {
+    int32_t       field;     // index into the field names, or
+                             // TEMPLATE_LITERAL for text
+    uint32_t      length;
+    const char   *text;
+} template_op;
+
+typedef struct {
+    template_op  *ops;
+    uint32_t      count;
+    uint64_t      fields;    // bit mask of the fields used in this part
+} template_part;
+
+typedef struct {
+    char         *text;
+    int           page;      // 0 if there is no {entries} block, and the
+                             // whole template is the entry part
+    template_part parts[TEMPLATE_PARTS];
+} template;
+
+int template_load(const char *filename, const char *const *fields,
+                  template **tpl);
+void template_free(template *tpl);
+
+#endif // _TEMPLATE_H
@@ -0,0 +1,222 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+                         NULL, 0);
+}
+
+/* Set up a ring with room for the given number of submissions.
+ *
+ * Returns 0 on success, or a negative errno value. -ENOSYS and -EPERM
+ * mean io_uring is not available and the caller should fall back.
+ */
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto clean;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            goto clean;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto clean;
+    }
+
+    sq = ring->sq_ptr;
+    ring->sq_head  = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    cq = ring->cq_ptr;
+    ring->cq_head  = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+ clean:
+    uring_exit(ring);
+    return -ENOMEM;
+}
+
+void uring_exit(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED &&
+        ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int uring_register_buffers(struct uring *ring, struct iovec *iov, unsigned nr)
+{
+    int ret;
+
+    ret = (int) syscall(__NR_io_uring_register, ring->fd,
+                        IORING_REGISTER_BUFFERS, iov, nr);
+    return ret < 0 ? -errno : 0;
+}
+
+/* Get the next free submission queue entry, zeroed. Returns NULL if the
+ * submission queue is full; call uring_submit() and try again.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head;
+    unsigned tail;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->entries) {
+        return NULL;
+    }
+
+    index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_pending++;
+
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Hand all prepared entries to the kernel, optionally waiting for wait_nr
+ * completions.
+ *
+ * Returns the number of entries submitted, or a negative errno value.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    unsigned submit = ring->sq_pending;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    do {
+        ret = sys_enter(ring->fd, submit, wait_nr,
+                        wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Wait for a completion. Returns NULL if waiting failed.
+ */
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    while ((cqe = uring_peek_cqe(ring)) == NULL) {
+        ret = sys_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
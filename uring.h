@@ -0,0 +1,67 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2018 Mathias Thore
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ***************************************************************************/
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#ifndef _URING_H
+#define _URING_H
+
+/* Minimal io_uring wrapper built directly on the system calls, so that
+ * jbf2html keeps building without liburing.
+ */
+struct uring {
+    int           fd;
+    unsigned      entries;
+
+    void         *sq_ptr;
+    size_t        sq_size;
+    unsigned     *sq_head;
+    unsigned     *sq_tail;
+    unsigned     *sq_mask;
+    unsigned     *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t        sqes_size;
+    unsigned      sq_pending;
+
+    void         *cq_ptr;
+    size_t        cq_size;
+    unsigned     *cq_head;
+    unsigned     *cq_tail;
+    unsigned     *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+int uring_register_buffers(struct uring *ring, struct iovec *iov, unsigned nr);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif // _URING_H